@@ -2,8 +2,22 @@
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 /*
  * Here is an high-level overview of the MDLX file format
@@ -157,11 +171,550 @@ struct DMA {
     unsigned int vif_off;
 };
 
-void write_packet(int vert_count, int bone_count, int face_count,
-                  unsigned int bones_drawn[], int faces_drawn[],
-                  unsigned int vertices_drawn[], int mp, int vifpkt,
-                  const aiMesh &mesh, char *name, int last, int bones_prec[],
-                  int mat_entries[], int dma_entries[]) {
+// the table following the model part headers
+struct mdl_bounds {
+    float min[4];
+    float max[4];
+    unsigned int res[4];
+    unsigned int unk1[56];
+    float unk2;
+    unsigned int res2[3];
+};
+static_assert(sizeof(struct mdl_bounds) == 0x120,
+              "the table is 0x120 bytes long in the game models");
+
+/*
+ * Some counts of the format are 16 bits wide: DMA.vif_len, the bone count and
+ * indices, the model part count. The DMA size and mat count of a model part
+ * are 32 bits, so there is nothing a model part could overflow by itself and
+ * we never split one.
+ *
+ * Packet data and matrices are unpacked relative to TOPS, so everything a
+ * packet puts in VU1 has to fit in its half of the double buffer, or it
+ * spills into the half the previous packet is still being drawn from. We
+ * don't know how the game splits VU1 memory, half of it is the most a packet
+ * can ever have.
+ *
+ * Anything past those silently wraps around and corrupts the file, so we
+ * check them all while building the model.
+ */
+#define MDL_U16_MAX 0xFFFF
+#define VU1_QWC_MAX 0x400
+#define VU1_BUF_QWC (VU1_QWC_MAX / 2)
+// the matrix window of a packet budget with -r, see mat_cache
+#define MAT_SLOTS(budget) ((budget) / 8)
+
+// every mesh gets a model part, with the mesh texture and bones
+struct mdl_part {
+    unsigned int mesh;
+    int vifpkt;
+    int mat_entries;
+    int dma_entries;
+    unsigned int subp_off;
+    // see mat_cache, with resident matrices every packet has mat_slots
+    // matrices at most, from mat_base
+    int resident;
+    unsigned int mat_base;
+    int mat_slots;
+    // see quantize_packet
+    int quantize;
+    float quant_scale[3];
+    float quant_off[3];
+    float quant_err;
+    long quant_saved;
+};
+
+// min/max reduction over the vertices, or only the ones listed in idx when
+// it isn't NULL. The w lane of each load is garbage that we don't care about,
+// which only leaves the very last vertex of the array that we can't load as a
+// whole.
+void vertex_bounds(const aiVector3D *vertices, unsigned int cnt,
+                   const unsigned int *idx, unsigned int vert_nmb,
+                   float min[4], float max[4]) {
+    if (cnt == 0) {
+        memset(min, 0, 4 * sizeof(float));
+        memset(max, 0, 4 * sizeof(float));
+        return;
+    }
+#ifdef __SSE__
+    __m128 vmin = _mm_set1_ps(INFINITY);
+    __m128 vmax = _mm_set1_ps(-INFINITY);
+    // two accumulators so consecutive vertices don't wait on each other
+    __m128 vmin2 = vmin;
+    __m128 vmax2 = vmax;
+    unsigned int i = 0;
+    for (; i + 1 < cnt; i += 2) {
+        unsigned int a = idx ? idx[i] : i;
+        unsigned int b = idx ? idx[i + 1] : i + 1;
+        __m128 va = a + 1 < vert_nmb ? _mm_loadu_ps(&vertices[a].x)
+                                     : _mm_set_ps(0, vertices[a].z,
+                                                  vertices[a].y, vertices[a].x);
+        __m128 vb = b + 1 < vert_nmb ? _mm_loadu_ps(&vertices[b].x)
+                                     : _mm_set_ps(0, vertices[b].z,
+                                                  vertices[b].y, vertices[b].x);
+        vmin = _mm_min_ps(vmin, va);
+        vmax = _mm_max_ps(vmax, va);
+        vmin2 = _mm_min_ps(vmin2, vb);
+        vmax2 = _mm_max_ps(vmax2, vb);
+    }
+    if (i < cnt) {
+        unsigned int a = idx ? idx[i] : i;
+        __m128 va = _mm_set_ps(0, vertices[a].z, vertices[a].y, vertices[a].x);
+        vmin = _mm_min_ps(vmin, va);
+        vmax = _mm_max_ps(vmax, va);
+    }
+    _mm_storeu_ps(min, _mm_min_ps(vmin, vmin2));
+    _mm_storeu_ps(max, _mm_max_ps(vmax, vmax2));
+#else
+    for (int k = 0; k < 3; k++) {
+        min[k] = INFINITY;
+        max[k] = -INFINITY;
+    }
+    for (unsigned int i = 0; i < cnt; i++) {
+        const aiVector3D &v = vertices[idx ? idx[i] : i];
+        min[0] = fminf(min[0], v.x);
+        min[1] = fminf(min[1], v.y);
+        min[2] = fminf(min[2], v.z);
+        max[0] = fmaxf(max[0], v.x);
+        max[1] = fmaxf(max[1], v.y);
+        max[2] = fmaxf(max[2], v.z);
+    }
+#endif
+    min[3] = 1;
+    max[3] = 1;
+}
+
+// header of a VIF packet once unpacked in VU1 memory, offsets are in qwc
+struct vif_header {
+    unsigned int type;
+    unsigned int color_ptr_inc;
+    unsigned int magic;
+    unsigned int vertex_buf_ptr;
+    unsigned int node_cnt;
+    unsigned int node_off;
+    unsigned int mat_cnt_off;
+    unsigned int mat_off;
+    unsigned int color_cnt;
+    unsigned int color_off;
+    unsigned int weight_cnt;
+    unsigned int weight_off;
+    unsigned int vert_cnt;
+    unsigned int vert_off;
+    unsigned int vert_idx_off;
+    unsigned int mat_cnt;
+};
+
+int in_file(size_t off, size_t len, size_t size) {
+    return off <= size && len <= size - off;
+}
+
+// Runs a VIF code stream, writing the unpacked data into vu, 4 words per qwc.
+// Only what the model packets need is supported, that is unpacks along with
+// the cycle, mode, mask and filling registers; the rest is skipped. When fmt
+// isn't NULL it gets the width of the fields each qwc was unpacked from.
+int vif_run(const unsigned char *vif, size_t len, unsigned int vu[],
+            unsigned char fmt[]) {
+    unsigned int cl = 1, wl = 1, mode = 0, mask = 0;
+    unsigned int row[4] = { 0, 0, 0, 0 };
+    unsigned int col[4] = { 0, 0, 0, 0 };
+    size_t pos = 0;
+    while (pos + 4 <= len) {
+        unsigned int code = *(const unsigned int *)(vif + pos);
+        unsigned int cmd = (code >> 24) & 0x7F;
+        unsigned int num = (code >> 16) & 0xFF;
+        unsigned int imm = code & 0xFFFF;
+        pos += 4;
+
+        if ((cmd & 0x60) == 0x60) {
+            // UNPACK
+            unsigned int vn = (cmd >> 2) & 3;
+            unsigned int vl = cmd & 3;
+            unsigned int bits = 32 >> vl;
+            unsigned int elem_nmb = num ? num : 256;
+            size_t elem_size = vl == 3 ? 2 : (bits / 8) * (vn + 1);
+            size_t data_len = (elem_nmb * elem_size + 3) & ~3;
+            if (!in_file(pos, data_len, len) || wl == 0 || wl > cl) {
+                return -1;
+            }
+            const unsigned char *data = vif + pos;
+            for (unsigned int j = 0; j < elem_nmb; j++) {
+                unsigned int addr = (imm & 0x3FF) + (j / wl) * cl + (j % wl);
+                unsigned int *dst = &vu[(addr % VU1_QWC_MAX) * 4];
+                if (fmt) {
+                    fmt[addr % VU1_QWC_MAX] = vl == 3 ? 5 : bits;
+                }
+                unsigned int val[4];
+                const unsigned char *e = data + j * elem_size;
+                if (vl == 3) {
+                    unsigned short c = *(const unsigned short *)e;
+                    val[0] = (c & 0x1F) << 3;
+                    val[1] = ((c >> 5) & 0x1F) << 3;
+                    val[2] = ((c >> 10) & 0x1F) << 3;
+                    val[3] = ((c >> 15) & 1) << 7;
+                } else {
+                    for (unsigned int k = 0; k < 4; k++) {
+                        // S is broadcast, V2 and V3 leave the remaining
+                        // fields undefined so we keep what was there
+                        unsigned int c = vn == 0 ? 0 : k;
+                        if (c > vn) {
+                            val[k] = dst[k];
+                            continue;
+                        }
+                        if (bits == 32) {
+                            val[k] = ((const unsigned int *)e)[c];
+                        } else if (bits == 16) {
+                            unsigned short v = ((const unsigned short *)e)[c];
+                            val[k] = (imm & 0x4000) ? v : (int)(short)v;
+                        } else {
+                            unsigned char v = e[c];
+                            val[k] = (imm & 0x4000) ? v : (int)(signed char)v;
+                        }
+                    }
+                }
+                unsigned int cycle = (j % wl) > 3 ? 3 : (j % wl);
+                for (unsigned int k = 0; k < 4; k++) {
+                    unsigned int m =
+                        (cmd & 0x10) ? (mask >> (cycle * 8 + k * 2)) & 3 : 0;
+                    if (m == 1) {
+                        dst[k] = row[k];
+                    } else if (m == 2) {
+                        dst[k] = col[cycle];
+                    } else if (m == 0) {
+                        if (mode == 1) {
+                            dst[k] = val[k] + row[k];
+                        } else if (mode == 2) {
+                            row[k] += val[k];
+                            dst[k] = row[k];
+                        } else {
+                            dst[k] = val[k];
+                        }
+                    }
+                }
+            }
+            pos += data_len;
+            continue;
+        }
+
+        switch (cmd) {
+        case 0x01: // STCYCL
+            cl = imm & 0xFF;
+            wl = imm >> 8;
+            break;
+        case 0x05: // STMOD
+            mode = imm & 3;
+            break;
+        case 0x20: // STMASK
+            if (!in_file(pos, 4, len)) {
+                return -1;
+            }
+            mask = *(const unsigned int *)(vif + pos);
+            pos += 4;
+            break;
+        case 0x30: // STROW
+        case 0x31: // STCOL
+            if (!in_file(pos, 16, len)) {
+                return -1;
+            }
+            memcpy(cmd == 0x30 ? row : col, vif + pos, 16);
+            pos += 16;
+            break;
+        case 0x4A: // MPG
+            pos += (num ? num : 256) * 8;
+            break;
+        case 0x50: // DIRECT
+        case 0x51: // DIRECTHL
+            pos += (imm ? imm : 0x10000) * 16;
+            break;
+        case 0x00: // NOP
+        case 0x02: // OFFSET
+        case 0x03: // BASE
+        case 0x04: // ITOP
+        case 0x06: // MSKPATH3
+        case 0x07: // MARK
+        case 0x10: // FLUSHE
+        case 0x11: // FLUSH
+        case 0x13: // FLUSHA
+        case 0x14: // MSCAL
+        case 0x15: // MSCALF
+        case 0x17: // MSCNT
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void mdl_part_init(struct mdl_part *part, unsigned int mesh_idx,
+                   const aiMesh &mesh, int quantize, int resident,
+                   int pkt_budget) {
+    part->mesh = mesh_idx;
+    part->vifpkt = 1;
+    part->mat_entries = 0;
+    part->dma_entries = 0;
+    part->subp_off = 0;
+    part->resident = resident;
+    part->mat_slots = resident ? MAT_SLOTS(pkt_budget) : 0;
+    part->mat_base = resident ? pkt_budget - 4 * part->mat_slots : 0;
+    part->quantize = quantize;
+    part->quant_err = 0;
+    part->quant_saved = 0;
+    // the grid spans the bounds of the vertices the part draws, 16 bits per
+    // axis
+    std::vector<char> drawn(mesh.mNumVertices, 0);
+    std::vector<unsigned int> idx;
+    for (unsigned int f = 0; f < mesh.mNumFaces; f++) {
+        for (unsigned int k = 0; k < mesh.mFaces[f].mNumIndices; k++) {
+            unsigned int v = mesh.mFaces[f].mIndices[k];
+            if (!drawn[v]) {
+                drawn[v] = 1;
+                idx.push_back(v);
+            }
+        }
+    }
+    float min[4], max[4];
+    vertex_bounds(mesh.mVertices, idx.size(), idx.data(), mesh.mNumVertices,
+                  min, max);
+    for (int k = 0; k < 3; k++) {
+        part->quant_off[k] = (min[k] + max[k]) / 2;
+        part->quant_scale[k] = (max[k] - min[k]) / 2 / 32767;
+        if (part->quant_scale[k] <= 0) {
+            part->quant_scale[k] = 1;
+        }
+    }
+}
+
+/*
+ * In quantized mode vertex positions are sent as 16 bits integers instead of
+ * floats, halving their share of the DMA transfers. The unpack still expands
+ * them to a full qwc in VU1 memory, so they take as much room there as
+ * before, and the microcode has to turn them back into positions itself as
+ * q * scale + offset. Scale and offset of the model part take the two qwc
+ * right before the matrices, which are at the model part mat_base when the
+ * packet leaves room for them there, and move up to make room otherwise.
+ *
+ * kh2vif only knows floats, so we rewrite its packets afterwards. Returns 1
+ * when the packet isn't one we know how to rewrite, it is then left as is.
+ */
+#define QUANT_QWC 2
+
+void vif_emit_unpack(std::vector<unsigned int> &out, unsigned int cmd,
+                     unsigned int addr, unsigned int flags,
+                     const unsigned int *words, unsigned int cnt,
+                     unsigned int elem_words) {
+    while (cnt) {
+        unsigned int num = cnt > 256 ? 256 : cnt;
+        out.push_back((cmd << 24) | ((num & 0xFF) << 16) | flags | addr);
+        out.insert(out.end(), words, words + num * elem_words);
+        words += num * elem_words;
+        addr += num;
+        cnt -= num;
+    }
+}
+
+int quantize_packet(const char *kh2vname, struct mdl_part *part) {
+    FILE *kh2v = fopen(kh2vname, "rb");
+    if (!kh2v) {
+        return -1;
+    }
+    fseek(kh2v, 0, SEEK_END);
+    long size = ftell(kh2v);
+    fseek(kh2v, 0, SEEK_SET);
+    unsigned char buf[size + 4];
+    if (fread(buf, 1, size, kh2v) != (size_t)size) {
+        fclose(kh2v);
+        return -1;
+    }
+    fclose(kh2v);
+
+    unsigned int flags = 0;
+    for (long pos = 0; pos + 4 <= size;) {
+        unsigned int code = *(unsigned int *)(buf + pos);
+        unsigned int cmd = (code >> 24) & 0x7F;
+        unsigned int num = (code >> 16) & 0xFF;
+        pos += 4;
+        if (cmd == 0x6C) {
+            flags = code & 0xC000;
+            pos += (num ? num : 256) * 16;
+        } else if (cmd != 0x00 && !(cmd == 0x01 && (code & 0xFFFF) == 0x101)) {
+            return 1;
+        }
+    }
+    unsigned int *vu =
+        (unsigned int *)calloc(VU1_QWC_MAX * 4, sizeof(unsigned int));
+    if (vif_run(buf, size, vu, NULL)) {
+        free(vu);
+        return 1;
+    }
+    struct vif_header hdr;
+    memcpy(&hdr, vu, sizeof(hdr));
+    if (hdr.vert_off == 0 || hdr.vert_off + hdr.vert_cnt > hdr.mat_off ||
+        hdr.mat_off + QUANT_QWC > VU1_QWC_MAX) {
+        free(vu);
+        return 1;
+    }
+
+    unsigned int vert_end = hdr.vert_off + hdr.vert_cnt;
+    unsigned int data_end = hdr.mat_off;
+    unsigned int quant_at = data_end;
+    if (part->mat_base <= VU1_QWC_MAX &&
+        part->mat_base >= data_end + QUANT_QWC) {
+        quant_at = part->mat_base - QUANT_QWC;
+    }
+    vu[7] = quant_at + QUANT_QWC;
+    memcpy(&vu[quant_at * 4], part->quant_scale, sizeof(part->quant_scale));
+    memcpy(&vu[(quant_at + 1) * 4], part->quant_off, sizeof(part->quant_off));
+    ((float *)vu)[quant_at * 4 + 3] = 0;
+    ((float *)vu)[(quant_at + 1) * 4 + 3] = 1;
+
+    unsigned int quant[hdr.vert_cnt * 2 + 1];
+    for (unsigned int v = 0; v < hdr.vert_cnt; v++) {
+        const float *p = (const float *)&vu[(hdr.vert_off + v) * 4];
+        short q[4] = { 0, 0, 0, 1 };
+        for (int k = 0; k < 3; k++) {
+            float f =
+                roundf((p[k] - part->quant_off[k]) / part->quant_scale[k]);
+            q[k] = f > 32767 ? 32767 : (f < -32767 ? -32767 : (short)f);
+            float err = fabsf(q[k] * part->quant_scale[k] +
+                              part->quant_off[k] - p[k]);
+            part->quant_err = fmaxf(part->quant_err, err);
+        }
+        memcpy(&quant[v * 2], q, sizeof(q));
+    }
+
+    std::vector<unsigned int> out;
+    out.push_back(0x01000101);
+    vif_emit_unpack(out, 0x6C, 0, flags, vu, hdr.vert_off, 4);
+    // the USN bit would zero extend the 16 bits fields, only FLG is kept
+    vif_emit_unpack(out, 0x6D, hdr.vert_off, flags & 0x8000, quant,
+                    hdr.vert_cnt, 2);
+    vif_emit_unpack(out, 0x6C, vert_end, flags, &vu[vert_end * 4],
+                    data_end - vert_end, 4);
+    vif_emit_unpack(out, 0x6C, quant_at, flags, &vu[quant_at * 4], QUANT_QWC,
+                    4);
+    while (out.size() % 4) {
+        out.push_back(0);
+    }
+    free(vu);
+
+    kh2v = fopen(kh2vname, "wb");
+    if (!kh2v) {
+        return -1;
+    }
+    fwrite(out.data(), sizeof(unsigned int), out.size(), kh2v);
+    fclose(kh2v);
+    part->quant_saved += size - (long)(out.size() * sizeof(unsigned int));
+    return 0;
+}
+
+/*
+ * Bone matrices are uploaded by the DMA chain into VU1 memory, one matrix slot
+ * (4 qwc) per bone drawn by the packet, from the address in word 7 of the
+ * packet header. Since the unpack is relative to TOPS and every packet kicks
+ * the microcode, consecutive packets land in alternating halves of the double
+ * buffer: a packet finds whatever matrices the packet two steps before it left
+ * in its own half.
+ *
+ * kh2vif puts the matrices right after the packet data, which moves with the
+ * vertex and face counts of every packet. With -r we move them to a fixed
+ * window at the end of the packet budget instead, MAT_SLOTS matrices long,
+ * and cut packets so their data ends before it and their bones fit in it.
+ * We then keep track of what is resident in each half so we can lay out bones
+ * in the slots they already occupy and skip their upload altogether.
+ *
+ * None of this has been checked on hardware: it relies on the game not
+ * touching the matrices between two packets using the same half, which is
+ * why it is opt-in.
+ */
+struct mat_cache {
+    unsigned int *slot_bone[2];
+    int slot_cnt[2];
+    unsigned int mat_vif_off[2];
+    int uploads;
+    int skipped;
+};
+
+void mat_cache_init(struct mat_cache *cache, unsigned int bone_nmb) {
+    for (int i = 0; i < 2; i++) {
+        cache->slot_bone[i] =
+            (unsigned int *)malloc((bone_nmb + 1) * sizeof(unsigned int));
+        cache->slot_cnt[i] = 0;
+        cache->mat_vif_off[i] = 0;
+    }
+    cache->uploads = 0;
+    cache->skipped = 0;
+}
+
+void mat_cache_free(struct mat_cache *cache) {
+    for (int i = 0; i < 2; i++) {
+        free(cache->slot_bone[i]);
+    }
+}
+
+// moves the matrices of the packet at kh2vname to mat_base, when its data
+// ends before it
+int place_matrices(const char *kh2vname, unsigned int mat_base) {
+    FILE *kh2v = fopen(kh2vname, "r+b");
+    if (!kh2v) {
+        return -1;
+    }
+    unsigned int mat_off;
+    fseek(kh2v, 0x24, SEEK_SET);
+    if (fread(&mat_off, 4, 1, kh2v) != 1) {
+        fclose(kh2v);
+        return -1;
+    }
+    if (mat_off < mat_base) {
+        fseek(kh2v, 0x24, SEEK_SET);
+        fwrite(&mat_base, 4, 1, kh2v);
+    }
+    fclose(kh2v);
+    return 0;
+}
+
+// reorders bones_drawn so that every bone still resident in the buffer half
+// this packet will use keeps its slot, new bones fill in the holes
+void assign_mat_slots(unsigned int bones_drawn[], int bone_count,
+                      const struct mat_cache *cache, int buf) {
+    unsigned int new_order[bone_count];
+    int used[bone_count];
+    int placed[bone_count];
+    for (int i = 0; i < bone_count; i++) {
+        used[i] = 0;
+        placed[i] = 0;
+    }
+    for (int i = 0; i < bone_count; i++) {
+        for (int s = 0; s < cache->slot_cnt[buf] && s < bone_count; s++) {
+            if (!used[s] && cache->slot_bone[buf][s] == bones_drawn[i]) {
+                new_order[s] = bones_drawn[i];
+                used[s] = 1;
+                placed[i] = 1;
+                break;
+            }
+        }
+    }
+    int s = 0;
+    for (int i = 0; i < bone_count; i++) {
+        if (placed[i]) {
+            continue;
+        }
+        while (used[s]) {
+            s++;
+        }
+        new_order[s] = bones_drawn[i];
+        used[s] = 1;
+    }
+    for (int i = 0; i < bone_count; i++) {
+        bones_drawn[i] = new_order[i];
+    }
+}
+
+int write_packet(int vert_count, int bone_count, int face_count,
+                 unsigned int bones_drawn[], int faces_drawn[],
+                 unsigned int vertices_drawn[], int mp, int vifpkt,
+                 const aiMesh &mesh, char *name, int last, int quiet,
+                 int bone_base, struct mdl_part *part,
+                 struct mat_cache *cache) {
     // should be enough chars for a lifetime
     char *filename = (char *)malloc(PATH_MAX * sizeof(char));
     sprintf(filename, "%s_mp%d_pkt%d.obj", name, mp, vifpkt);
@@ -179,7 +732,12 @@ void write_packet(int vert_count, int bone_count, int face_count,
     // sort vertices per bones, rearrange the model to draw
     // to file
     // we do not sort bones as we sort vertices based on bone
-    // order
+    // order, we only move them around so they reuse their resident
+    // matrix slot
+    int buf = vifpkt % 2;
+    if (part->resident) {
+        assign_mat_slots(bones_drawn, bone_count, cache, buf);
+    }
     int bone_to_vertex[bone_count];
     for (int i = 0; i < bone_count; i++) {
         bone_to_vertex[i] = 0;
@@ -274,20 +832,39 @@ void write_packet(int vert_count, int bone_count, int face_count,
     char *kh2vname = (char *)malloc(PATH_MAX * sizeof(char));
     char *dmaname = (char *)malloc(PATH_MAX * sizeof(char));
     char *matname = (char *)malloc(PATH_MAX * sizeof(char));
-    char *makepkt = (char *)malloc((PATH_MAX + 10) * sizeof(char));
+    char *makepkt = (char *)malloc((PATH_MAX + 24) * sizeof(char));
     sprintf(kh2vname, "%s_mp%d_pkt%d.kh2v", name, mp, vifpkt);
     sprintf(dmaname, "%s_mp%d_pkt%d.dma", name, mp, vifpkt);
     sprintf(matname, "%s_mp%d_pkt%d.mat", name, mp, vifpkt);
 
     fclose(pkt);
 
-    sprintf(makepkt, "kh2vif \"%s\"", filename);
+    sprintf(makepkt, "kh2vif \"%s\"%s", filename, quiet ? " > /dev/null" : "");
     system(makepkt);
 
+    if (part->quantize && quantize_packet(kh2vname, part) && !quiet) {
+        printf("warning: MP %d packet %d can't be quantized, keeping floats\n",
+               part->mesh + 1, vifpkt);
+    }
+    if (part->resident && place_matrices(kh2vname, part->mat_base)) {
+        if (!quiet) {
+            printf("error: can't read %s\n", kh2vname);
+        }
+        return -1;
+    }
+
     // scanf("%d\n");
     FILE *kh2v = fopen(kh2vname, "rb");
+    if (!kh2v) {
+        if (!quiet) {
+            printf("error: kh2vif didn't convert MP %d packet %d\n",
+                   part->mesh + 1, vifpkt);
+        }
+        remove(filename);
+        return -1;
+    }
     fseek(kh2v, 0x24, SEEK_SET);
-    char mat_vif_off;
+    unsigned int mat_vif_off;
     fread(&mat_vif_off, 4, 1, kh2v);
     fseek(kh2v, 0x44, SEEK_SET);
     int mat_cnt = 0;
@@ -298,45 +875,92 @@ void write_packet(int vert_count, int bone_count, int face_count,
     FILE *dma_file = fopen(dmaname, "wb");
     struct DMA *dma_entry = (DMA *)malloc(sizeof(struct DMA));
     fseek(kh2v, 0x0, SEEK_END);
-    dma_entry->vif_len = ftell(kh2v) / 16;
+    long vif_qwc = ftell(kh2v) / 16;
+    dma_entry->vif_len = vif_qwc;
     dma_entry->res1 = 0x3000;
 
     fclose(kh2v);
+    if (vif_qwc > MDL_U16_MAX ||
+        mat_vif_off + (bone_count * 4) > VU1_BUF_QWC ||
+        (part->resident && (mat_vif_off != part->mat_base ||
+                            bone_count > part->mat_slots))) {
+        if (!quiet) {
+            printf("error: MP %d packet %d is too big for VU1 (%ld qwc, "
+                   "matrices at %d)\n",
+                   part->mesh + 1, vifpkt, vif_qwc, mat_vif_off);
+        }
+        fclose(dma_file);
+        return -1;
+    }
     // TOFIX: we don't know yet where in the final file our packet will
     // end up so we blank it out for now.
     dma_entry->vif_off = 0;
     char vif_empty[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
     fwrite(dma_entry, 1, sizeof(struct DMA), dma_file);
     fwrite(vif_empty, 1, sizeof(vif_empty), dma_file);
-    dma_entries[mp - 1]++;
+    part->dma_entries++;
+
+    // a slot is only still valid if the packet that left it there had its
+    // matrices at the same place, which is mat_base unless a packet overran
+    // it. The first packet of a model part can't rely on anything.
+    int resident[bone_count];
     for (int i = 0; i < bone_count; i++) {
+        resident[i] = part->resident && vifpkt > 2 &&
+                      cache->mat_vif_off[buf] == mat_vif_off &&
+                      i < cache->slot_cnt[buf] &&
+                      cache->slot_bone[buf][i] == bones_drawn[i];
+        if (resident[i]) {
+            cache->skipped++;
+        } else {
+            cache->uploads++;
+        }
+        cache->slot_bone[buf][i] = bones_drawn[i];
+    }
+    cache->slot_cnt[buf] = bone_count;
+    cache->mat_vif_off[buf] = mat_vif_off;
+
+    for (int i = 0; i < bone_count; i++) {
+        if (resident[i]) {
+            continue;
+        }
         dma_entry->vif_len = 4;
         dma_entry->res1 = 0x3000;
 
-        dma_entry->vif_off = bones_drawn[i] + bones_prec[mp - 1];
+        dma_entry->vif_off = bones_drawn[i] + bone_base;
         unsigned char vif_inst[] = { 0x01, 0x01, 0x00, 0x01,
                                      0x00, 0x80, 0x04, 0x6C };
-        vif_inst[4] = mat_vif_off + (i * 4);
+        // the address doesn't fit in a byte past slot 63, its top bits go
+        // along the double buffering flag
+        vif_inst[4] = (mat_vif_off + (i * 4)) & 0xFF;
+        vif_inst[5] |= ((mat_vif_off + (i * 4)) >> 8) & 0x3;
         fwrite(dma_entry, 1, sizeof(struct DMA), dma_file);
         fwrite(vif_inst, 1, sizeof(vif_inst), dma_file);
-        dma_entries[mp - 1]++;
+        part->dma_entries++;
     }
     char end_dma[] = { 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00,
                        0x00, 0x00, 0x00, 0x17, 0x00, 0x00, 0x00, 0x00 };
     fwrite(end_dma, 1, sizeof(end_dma), dma_file);
-    dma_entries[mp - 1]++;
+    part->dma_entries++;
 
     FILE *mat_file = fopen(matname, "wb");
     // the count of mat entries, we need to modify that!
     if (vifpkt == 1) {
         fwrite(&mat_cnt, 1, sizeof(mat_cnt), mat_file);
     }
+    // the mat table has to stay in sync with the matrix DMA tags, so resident
+    // bones are left out of it as well
     for (int i = 0; i < bone_count; i++) {
-        int bones_new = bones_drawn[i] + bones_prec[mp - 1];
-        printf("original bone: %d, new: %d\n", bones_drawn[i], bones_new);
+        if (resident[i]) {
+            continue;
+        }
+        int bones_new = bones_drawn[i] + bone_base;
+        if (!quiet) {
+            printf("original bone: %d, new: %d\n", bones_drawn[i], bones_new);
+            printf("MP %d, incremeting number of mat entries\n",
+                   part->mesh + 1);
+        }
         fwrite(&bones_new, 1, sizeof(bones_new), mat_file);
-        printf("MP %d, incremeting number of mat entries\n", mp);
-        mat_entries[mp - 1]++;
+        part->mat_entries++;
     }
 
     int end_mat = -1;
@@ -346,27 +970,1358 @@ void write_packet(int vert_count, int bone_count, int face_count,
     fwrite(&end_mat, 1, sizeof(end_mat), mat_file);
 
     if (!last) {
-        printf("MP %d, incremeting number of mat entries\n", mp);
-        mat_entries[mp - 1]++;
+        if (!quiet) {
+            printf("MP %d, incremeting number of mat entries\n",
+                   part->mesh + 1);
+        }
+        part->mat_entries++;
     }
 
     fclose(dma_file);
     fclose(mat_file);
     // TODO: write Mati here
     // remove(kh2vname);
+    return 0;
+}
+
+/*
+ * There is more than one way to cut a mesh into packets: smaller packets hold
+ * fewer bones each, and faces grouped by bone share more of them from one
+ * packet to the next. None wins for every mesh, so we can build it several
+ * ways and keep whichever ends up the smallest.
+ */
+// the largest packet we know to be safe, in qwc, and the smaller ones we try
+#define PKT_BUDGET 100
+#define PKT_BUDGET_MIN 40
+#define PKT_BUDGET_STEP 10
+
+// faces in the order of the mesh, or sorted by the bone weighting their first
+// vertex the most
+#define STRATEGY_SOURCE 0
+#define STRATEGY_BONE 1
+#define STRATEGY_NMB 2
+const char *strategy_names[STRATEGY_NMB] = { "source", "bone" };
+
+struct mesh_build {
+    unsigned int mesh;
+    int pkt_budget;
+    int strategy;
+    // where the intermediate files go until we pick a build
+    char *prefix;
+    // trial builds of -O keep quiet, main reports the ones that failed
+    int quiet;
+    struct mdl_part part;
+    int mat_uploads;
+    int mat_skipped;
+    long size;
+    int dma_entries;
+    int ret;
+};
+
+// the intermediate files of every packet of a build are either moved to
+// their final name, the model part of the mesh, or removed when to is NULL
+void mesh_build_files(const struct mesh_build *build, const char *to) {
+    const char *ext[3] = { "kh2v", "dma", "mat" };
+    char *from_name = (char *)malloc(PATH_MAX * sizeof(char));
+    char *to_name = (char *)malloc(PATH_MAX * sizeof(char));
+    for (int y = 0; y < build->part.vifpkt; y++) {
+        for (int e = 0; e < 3; e++) {
+            snprintf(from_name, PATH_MAX, "%s_mp1_pkt%d.%s", build->prefix,
+                     y + 1, ext[e]);
+            if (to) {
+                snprintf(to_name, PATH_MAX, "%s_mp%d_pkt%d.%s", to,
+                         build->mesh + 1, y + 1, ext[e]);
+                rename(from_name, to_name);
+            } else {
+                remove(from_name);
+            }
+        }
+    }
+    free(from_name);
+    free(to_name);
 }
+
+// the bones of face that aren't in bones_drawn yet
+int face_new_bones(const aiMesh &mesh, const aiFace &face,
+                   const unsigned int bones_drawn[], int bone_count) {
+    int new_bones = 0;
+    for (unsigned int d = 0; d < mesh.mNumBones; d++) {
+        int drawn = 0;
+        for (int f = 0; f < bone_count && !drawn; f++) {
+            drawn = bones_drawn[f] == d;
+        }
+        for (unsigned int e = 0; e < mesh.mBones[d]->mNumWeights && !drawn;
+             e++) {
+            unsigned int v = mesh.mBones[d]->mWeights[e].mVertexId;
+            if (v == face.mIndices[0] || v == face.mIndices[1] ||
+                v == face.mIndices[2]) {
+                new_bones++;
+                break;
+            }
+        }
+    }
+    return new_bones;
+}
+
+// cuts mesh into packets as build says, then measures the result
+void build_mesh(const aiMesh &mesh, int bone_base, int quantize,
+                int resident, struct mesh_build *build) {
+    build->mat_uploads = 0;
+    build->mat_skipped = 0;
+    build->size = 0;
+    build->dma_entries = 0;
+    build->ret = 0;
+    unsigned int i = build->mesh;
+    int pkt_budget = build->pkt_budget;
+    char *name = build->prefix;
+    struct mdl_part *part = &build->part;
+
+    unsigned int *face_order =
+        (unsigned int *)malloc((mesh.mNumFaces + 1) * sizeof(unsigned int));
+    for (unsigned int y = 0; y < mesh.mNumFaces; y++) {
+        face_order[y] = y;
+    }
+    if (build->strategy == STRATEGY_BONE) {
+        std::vector<int> vert_bone(mesh.mNumVertices, -1);
+        std::vector<float> vert_weight(mesh.mNumVertices, 0);
+        for (unsigned int d = 0; d < mesh.mNumBones; d++) {
+            for (unsigned int e = 0; e < mesh.mBones[d]->mNumWeights; e++) {
+                const aiVertexWeight &w = mesh.mBones[d]->mWeights[e];
+                if (w.mWeight > vert_weight[w.mVertexId]) {
+                    vert_weight[w.mVertexId] = w.mWeight;
+                    vert_bone[w.mVertexId] = d;
+                }
+            }
+        }
+        std::stable_sort(face_order, face_order + mesh.mNumFaces,
+                         [&](unsigned int a, unsigned int b) {
+                             return vert_bone[mesh.mFaces[a].mIndices[0]] <
+                                    vert_bone[mesh.mFaces[b].mIndices[0]];
+                         });
+    }
+    mdl_part_init(part, i, mesh, quantize, resident, pkt_budget);
+    // the matrices go in their own window with -r, the data gets the rest
+    int data_budget = resident ? (int)part->mat_base : pkt_budget;
+    int vert_count = 0;
+    int face_count = 0;
+    int bone_count = 0;
+    // for some reason those arrays aren't initialized as 0...?
+    // they're on the heap as we might not be on the main thread, with its
+    // big stack
+    unsigned int *vertices_drawn =
+        (unsigned int *)malloc((mesh.mNumVertices + 1) * sizeof(unsigned int));
+    for (unsigned int z = 0; z < mesh.mNumVertices; z++) {
+        vertices_drawn[z] = 0;
+    }
+    unsigned int *bones_drawn =
+        (unsigned int *)malloc((mesh.mNumBones + 1) * sizeof(unsigned int));
+    for (unsigned int z = 0; z < mesh.mNumBones; z++) {
+        bones_drawn[z] = 0;
+    }
+    int *faces_drawn = (int *)malloc((mesh.mNumFaces + 1) * sizeof(int));
+    for (unsigned int z = 0; z < mesh.mNumFaces; z++) {
+        faces_drawn[z] = 0;
+    }
+    struct mat_cache cache;
+    mat_cache_init(&cache, mesh.mNumBones);
+
+    // we are writing a custom interlaced, bone-supporting obj here,
+    // don't assume everything is following the obj standard!
+    // printf("Generating Model Part %d, packet %d\n", i+1, vifpkt);
+    for (unsigned int y = 0; y < mesh.mNumFaces; y++) {
+        const aiFace &face = mesh.mFaces[face_order[y]];
+
+        // we make the biggest vif packet, possible, for this, here
+        // is the size that each type of entry takes:
+        //
+        // header - 4 qwc
+        // bones - 1/4 of a qwc + 4 qwc(DMA tags)
+        // vertices - 1 qwc, even quantized once in VU1 memory
+        // Face drawing - 3 qwc, UV and flags are bundled with it
+        // quantization parameters - 2 qwc when quantizing
+        // we here take the worst case scenario to ensure the vif
+        // packet < the maximum size
+        // with -r the matrices are not part of the data, they must fit in
+        // their window instead
+        int mat_qwc = resident ? 0 : 4 * (bone_count + 3);
+        int fits = (((ceil((bone_count + 3) / 4) + mat_qwc) +
+                     (vert_count + 3) + ((face_count + 1) * 3)) +
+                    4 + (quantize ? QUANT_QWC : 0)) < data_budget;
+        if (fits && resident) {
+            fits = bone_count + face_new_bones(mesh, face, bones_drawn,
+                                               bone_count) <=
+                   part->mat_slots;
+        }
+        if (fits) {
+            // we update faces
+            faces_drawn[face_count] = face_order[y];
+            face_count++;
+            // we update bones
+            // printf("This face has the vertices %d %d
+            // %d\n",mesh.mFaces[y].mIndices[0],mesh.mFaces[y].mIndices[1],
+            // mesh.mFaces[y].mIndices[2]);
+            int tmp_check = 0;
+            for (unsigned int d = 0; d < mesh.mNumBones; d++) {
+                for (unsigned int e = 0; e < mesh.mBones[d]->mNumWeights;
+                     e++) {
+                    tmp_check = 0;
+                    if (mesh.mBones[d]->mWeights[e].mVertexId ==
+                            face.mIndices[0] ||
+                        mesh.mBones[d]->mWeights[e].mVertexId ==
+                            face.mIndices[1] ||
+                        mesh.mBones[d]->mWeights[e].mVertexId ==
+                            face.mIndices[2]) {
+                        for (int f = 0; f < bone_count; f++) {
+                            if (bones_drawn[f] == d) {
+                                tmp_check = 1;
+                            }
+                        }
+                        // if we find a vertex of this face
+                        // associated to any bone and it is not a
+                        // duplicate we add it
+                        if (tmp_check == 0) {
+                            bones_drawn[bone_count] = d;
+                            bone_count++;
+                        }
+                    }
+                }
+            }
+            tmp_check = 0;
+            // we update vertices
+            for (int d = 0; d < vert_count; d++) {
+                if (vertices_drawn[d] == face.mIndices[0]) {
+                    tmp_check = 1;
+                }
+            }
+            if (tmp_check == 0) {
+                vertices_drawn[vert_count] = face.mIndices[0];
+                vert_count++;
+            }
+            tmp_check = 0;
+            for (int d = 0; d < vert_count; d++) {
+                if (vertices_drawn[d] == face.mIndices[1]) {
+                    tmp_check = 1;
+                }
+            }
+            if (tmp_check == 0) {
+                vertices_drawn[vert_count] = face.mIndices[1];
+                vert_count++;
+            }
+            tmp_check = 0;
+            for (int d = 0; d < vert_count; d++) {
+                if (vertices_drawn[d] == face.mIndices[2]) {
+                    tmp_check = 1;
+                }
+            }
+            if (tmp_check == 0) {
+                vertices_drawn[vert_count] = face.mIndices[2];
+                vert_count++;
+            }
+
+            if (y == mesh.mNumFaces - 1) {
+                if (write_packet(vert_count, bone_count, face_count,
+                                 bones_drawn, faces_drawn, vertices_drawn,
+                                 1, part->vifpkt, mesh, name, 1,
+                                 build->quiet, bone_base, part, &cache)) {
+                    build->ret = -1;
+                    break;
+                }
+            }
+
+        } else {
+            // not even a face on its own fits, no packet will ever take it
+            if (face_count == 0) {
+                if (!build->quiet) {
+                    printf("error: a face of mesh %d doesn't fit in a %d qwc "
+                           "packet\n",
+                           i + 1, pkt_budget);
+                }
+                build->ret = -1;
+                break;
+            }
+            if (write_packet(vert_count, bone_count, face_count,
+                             bones_drawn, faces_drawn, vertices_drawn,
+                             1, part->vifpkt, mesh, name, 0, build->quiet,
+                             bone_base, part, &cache)) {
+                build->ret = -1;
+                break;
+            }
+            y--;
+            part->vifpkt++;
+            face_count = 0;
+            bone_count = 0;
+            vert_count = 0;
+            for (unsigned int z = 0; z < mesh.mNumVertices; z++) {
+                vertices_drawn[z] = 0;
+            }
+            for (unsigned int z = 0; z < mesh.mNumBones; z++) {
+                bones_drawn[z] = 0;
+            }
+            for (unsigned int z = 0; z < mesh.mNumFaces; z++) {
+                faces_drawn[z] = 0;
+            }
+            // printf("Generating Model Part %d, packet %d\n", i+1, vifpkt);
+        }
+        // fclose(pkt);
+    }
+    build->mat_uploads += cache.uploads;
+    build->mat_skipped += cache.skipped;
+    mat_cache_free(&cache);
+    free(vertices_drawn);
+    free(bones_drawn);
+    free(faces_drawn);
+    free(face_order);
+
+    // the encoded size is everything that ends up in the file for this mesh
+    const char *ext[3] = { "kh2v", "dma", "mat" };
+    char *filename = (char *)malloc(PATH_MAX * sizeof(char));
+    build->dma_entries = part->dma_entries;
+    for (int y = 0; y < part->vifpkt; y++) {
+        for (int e = 0; e < 3; e++) {
+            struct stat st;
+            snprintf(filename, PATH_MAX, "%s_mp1_pkt%d.%s", name, y + 1,
+                     ext[e]);
+            if (stat(filename, &st) == 0) {
+                build->size += st.st_size;
+            }
+        }
+    }
+    free(filename);
+}
+
+/*
+ * The 0x17 entry is a list of simple shapes, each attached to a bone, that the
+ * game tests for pushing actors around, hits and lock-on. There is no way to
+ * store a mesh or a hull in there, the closest we get are columns (vertical
+ * cylinders) and spheres.
+ *
+ * We assign every triangle to the bone weighting it the most, build a binned
+ * SAH BVH over the triangles of each bone and fit a shape to each of its
+ * leaves, so a long limb gets a few snug columns instead of one loose one.
+ */
+struct coll_entry {
+    unsigned char group;
+    unsigned char parts;
+    short argument;
+    unsigned char type;
+    unsigned char shape;
+    short bone;
+    short pos_x;
+    short pos_y;
+    short pos_z;
+    short pos_height;
+    short radius;
+    short height;
+};
+
+#define COLL_SHAPE_COLUMN 1
+#define COLL_SHAPE_SPHERE 3
+#define COLL_TYPE_OBJECT 1
+// a bone never gets more than 1 << COLL_MAX_DEPTH shapes
+#define COLL_MAX_DEPTH 2
+#define COLL_MIN_TRIS 8
+#define COLL_SAH_BINS 8
+// a split has to shrink the volume of the shapes at least that much
+#define COLL_SPLIT_GAIN 0.75f
+
+struct coll_tri {
+    int bone;
+    float p[9];
+};
+
+bool coll_tri_cmp(const struct coll_tri &a, const struct coll_tri &b) {
+    return a.bone < b.bone;
+}
+
+void coll_bounds(const struct coll_tri *tris, int cnt, float min[3],
+                 float max[3]) {
+    for (int k = 0; k < 3; k++) {
+        min[k] = INFINITY;
+        max[k] = -INFINITY;
+    }
+    for (int t = 0; t < cnt; t++) {
+        for (int v = 0; v < 3; v++) {
+            for (int k = 0; k < 3; k++) {
+                min[k] = fminf(min[k], tris[t].p[v * 3 + k]);
+                max[k] = fmaxf(max[k], tris[t].p[v * 3 + k]);
+            }
+        }
+    }
+}
+
+float coll_area(const float min[3], const float max[3]) {
+    float d[3];
+    for (int k = 0; k < 3; k++) {
+        d[k] = max[k] > min[k] ? max[k] - min[k] : 0;
+    }
+    return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+short coll_short(float v) {
+    v = roundf(v);
+    if (v > 32767) {
+        return 32767;
+    }
+    if (v < -32768) {
+        return -32768;
+    }
+    return (short)v;
+}
+
+// fits the tightest column around the triangles, or a sphere when they are
+// flatter than they are wide, and returns its volume
+float coll_fit(const struct coll_tri *tris, int cnt, struct coll_entry *e) {
+    float min[3], max[3];
+    coll_bounds(tris, cnt, min, max);
+    float cx = (min[0] + max[0]) / 2;
+    float cz = (min[2] + max[2]) / 2;
+    float cy = (min[1] + max[1]) / 2;
+    float radius = 0;
+    float sphere = 0;
+    for (int t = 0; t < cnt; t++) {
+        for (int v = 0; v < 3; v++) {
+            const float *p = &tris[t].p[v * 3];
+            float dx = p[0] - cx, dy = p[1] - cy, dz = p[2] - cz;
+            radius = fmaxf(radius, sqrtf(dx * dx + dz * dz));
+            sphere = fmaxf(sphere, sqrtf(dx * dx + dy * dy + dz * dz));
+        }
+    }
+    memset(e, 0, sizeof(*e));
+    e->type = COLL_TYPE_OBJECT;
+    e->bone = tris[0].bone;
+    e->pos_x = coll_short(cx);
+    e->pos_y = coll_short(cy);
+    e->pos_z = coll_short(cz);
+    if (max[1] - min[1] < radius) {
+        e->shape = COLL_SHAPE_SPHERE;
+        e->radius = coll_short(ceilf(sphere));
+        return 4.0f / 3 * M_PI * e->radius * e->radius * e->radius;
+    }
+    e->shape = COLL_SHAPE_COLUMN;
+    e->radius = coll_short(ceilf(radius));
+    e->height = coll_short(ceilf(max[1] - min[1]));
+    return M_PI * e->radius * e->radius * e->height;
+}
+
+// returns the volume of the shapes we ended up with
+float coll_build(struct coll_tri *tris, int cnt, int depth,
+                 std::vector<coll_entry> &entries) {
+    struct coll_entry leaf;
+    float leaf_vol = coll_fit(tris, cnt, &leaf);
+    float min[3], max[3];
+    coll_bounds(tris, cnt, min, max);
+    if (depth >= COLL_MAX_DEPTH || cnt < 2 * COLL_MIN_TRIS) {
+        entries.push_back(leaf);
+        return leaf_vol;
+    }
+
+    // bin the centroids along the widest axis and pick the split with the
+    // lowest surface area heuristic
+    float cmin[3] = { INFINITY, INFINITY, INFINITY };
+    float cmax[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (int t = 0; t < cnt; t++) {
+        for (int k = 0; k < 3; k++) {
+            float c = (tris[t].p[k] + tris[t].p[3 + k] + tris[t].p[6 + k]) / 3;
+            cmin[k] = fminf(cmin[k], c);
+            cmax[k] = fmaxf(cmax[k], c);
+        }
+    }
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (cmax[k] - cmin[k] > cmax[axis] - cmin[axis]) {
+            axis = k;
+        }
+    }
+    float extent = cmax[axis] - cmin[axis];
+    if (extent <= 0) {
+        entries.push_back(leaf);
+        return leaf_vol;
+    }
+    int bin_cnt[COLL_SAH_BINS];
+    float bin_min[COLL_SAH_BINS][3], bin_max[COLL_SAH_BINS][3];
+    for (int b = 0; b < COLL_SAH_BINS; b++) {
+        bin_cnt[b] = 0;
+        for (int k = 0; k < 3; k++) {
+            bin_min[b][k] = INFINITY;
+            bin_max[b][k] = -INFINITY;
+        }
+    }
+    std::vector<int> bin_of(cnt);
+    for (int t = 0; t < cnt; t++) {
+        float c = (tris[t].p[axis] + tris[t].p[3 + axis] +
+                   tris[t].p[6 + axis]) /
+                  3;
+        int b = (int)((c - cmin[axis]) / extent * COLL_SAH_BINS);
+        b = b >= COLL_SAH_BINS ? COLL_SAH_BINS - 1 : b;
+        bin_of[t] = b;
+        bin_cnt[b]++;
+        for (int v = 0; v < 3; v++) {
+            for (int k = 0; k < 3; k++) {
+                bin_min[b][k] = fminf(bin_min[b][k], tris[t].p[v * 3 + k]);
+                bin_max[b][k] = fmaxf(bin_max[b][k], tris[t].p[v * 3 + k]);
+            }
+        }
+    }
+    float best_cost = cnt * coll_area(min, max);
+    int best_split = -1;
+    for (int s = 1; s < COLL_SAH_BINS; s++) {
+        float lmin[3] = { INFINITY, INFINITY, INFINITY };
+        float lmax[3] = { -INFINITY, -INFINITY, -INFINITY };
+        float rmin[3] = { INFINITY, INFINITY, INFINITY };
+        float rmax[3] = { -INFINITY, -INFINITY, -INFINITY };
+        int lcnt = 0, rcnt = 0;
+        for (int b = 0; b < COLL_SAH_BINS; b++) {
+            float *bmin = b < s ? lmin : rmin;
+            float *bmax = b < s ? lmax : rmax;
+            for (int k = 0; k < 3; k++) {
+                bmin[k] = fminf(bmin[k], bin_min[b][k]);
+                bmax[k] = fmaxf(bmax[k], bin_max[b][k]);
+            }
+            if (b < s) {
+                lcnt += bin_cnt[b];
+            } else {
+                rcnt += bin_cnt[b];
+            }
+        }
+        if (lcnt < COLL_MIN_TRIS || rcnt < COLL_MIN_TRIS) {
+            continue;
+        }
+        float cost =
+            lcnt * coll_area(lmin, lmax) + rcnt * coll_area(rmin, rmax);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_split = s;
+        }
+    }
+    if (best_split < 0) {
+        entries.push_back(leaf);
+        return leaf_vol;
+    }
+
+    int mid = 0;
+    for (int t = 0; t < cnt; t++) {
+        if (bin_of[t] < best_split) {
+            struct coll_tri tmp = tris[t];
+            tris[t] = tris[mid];
+            tris[mid] = tmp;
+            int tmp_bin = bin_of[t];
+            bin_of[t] = bin_of[mid];
+            bin_of[mid] = tmp_bin;
+            mid++;
+        }
+    }
+    // a uniform limb splits nicely by area but not by volume, in which case
+    // a single shape does the job for less
+    size_t entry_cnt = entries.size();
+    float split_vol = coll_build(tris, mid, depth + 1, entries);
+    split_vol += coll_build(tris + mid, cnt - mid, depth + 1, entries);
+    if (split_vol > leaf_vol * COLL_SPLIT_GAIN) {
+        entries.resize(entry_cnt);
+        entries.push_back(leaf);
+        return leaf_vol;
+    }
+    return split_vol;
+}
+
+// bone_idx maps the bones of each mesh of scene to the bone table, -1 for
+// the ones the model doesn't have
+int write_collision(const aiScene *scene, int *bone_idx[], const char *name) {
+    std::vector<coll_tri> tris;
+    int dropped = 0;
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
+        const aiMesh &mesh = *scene->mMeshes[i];
+        // the bone weighting each vertex the most, -1 when none of its bones
+        // is in the model
+        int vert_bone[mesh.mNumVertices + 1];
+        float vert_weight[mesh.mNumVertices + 1];
+        for (unsigned int v = 0; v < mesh.mNumVertices; v++) {
+            vert_bone[v] = -1;
+            vert_weight[v] = 0;
+        }
+        for (unsigned int b = 0; b < mesh.mNumBones; b++) {
+            if (bone_idx[i][b] < 0) {
+                continue;
+            }
+            for (unsigned int w = 0; w < mesh.mBones[b]->mNumWeights; w++) {
+                const aiVertexWeight &weight = mesh.mBones[b]->mWeights[w];
+                if (weight.mWeight > vert_weight[weight.mVertexId]) {
+                    vert_weight[weight.mVertexId] = weight.mWeight;
+                    vert_bone[weight.mVertexId] = bone_idx[i][b];
+                }
+            }
+        }
+        for (unsigned int f = 0; f < mesh.mNumFaces; f++) {
+            if (mesh.mFaces[f].mNumIndices != 3) {
+                continue;
+            }
+            const unsigned int *idx = mesh.mFaces[f].mIndices;
+            struct coll_tri tri;
+            // majority vote, the first vertex wins a three-way tie
+            tri.bone = vert_bone[idx[1]] == vert_bone[idx[2]]
+                           ? vert_bone[idx[1]]
+                           : vert_bone[idx[0]];
+            for (int v = 0; v < 3 && tri.bone < 0; v++) {
+                tri.bone = vert_bone[idx[v]];
+            }
+            // attaching those to the root would be worse than nothing
+            if (tri.bone < 0) {
+                dropped++;
+                continue;
+            }
+            for (int v = 0; v < 3; v++) {
+                tri.p[v * 3] = mesh.mVertices[idx[v]].x;
+                tri.p[v * 3 + 1] = mesh.mVertices[idx[v]].y;
+                tri.p[v * 3 + 2] = mesh.mVertices[idx[v]].z;
+            }
+            tris.push_back(tri);
+        }
+    }
+    if (dropped) {
+        printf("warning: %d collision triangles have no bone of the model, "
+               "they get no collision\n",
+               dropped);
+    }
+    std::stable_sort(tris.begin(), tris.end(), coll_tri_cmp);
+
+    std::vector<coll_entry> entries;
+    size_t start = 0;
+    for (size_t t = 1; t <= tris.size(); t++) {
+        if (t == tris.size() || tris[t].bone != tris[start].bone) {
+            coll_build(&tris[start], t - start, 0, entries);
+            start = t;
+        }
+    }
+
+    std::string kh2cname =
+        std::string(name).substr(0, std::string(name).find_last_of('.')) +
+        ".kh2c";
+    FILE *coll = fopen(kh2cname.c_str(), "wb");
+    if (!coll) {
+        printf("error: can't write %s\n", kh2cname.c_str());
+        return -1;
+    }
+    // the entry count, padded to a qwc
+    unsigned int coll_hdr[4] = { (unsigned int)entries.size(), 0, 0, 0 };
+    fwrite(coll_hdr, 1, sizeof(coll_hdr), coll);
+    if (!entries.empty()) {
+        fwrite(entries.data(), sizeof(struct coll_entry), entries.size(),
+               coll);
+    }
+    fclose(coll);
+    printf("Collision: %zu shapes for %zu triangles\n", entries.size(),
+           tris.size());
+    return 0;
+}
+
+/*
+ * Exporting goes the other way around: we take an existing model, either a
+ * BAR archive holding a 0x04 entry or a bare .kh2m as written above, replay
+ * the DMA chain of each model part and decode its VIF packets like the VIF
+ * would, into a VU1 memory image. The packet header then tells us where the
+ * strip nodes, vertices and per bone vertex counts landed.
+ *
+ * Packets from the game weight vertices between several bones: a vertex with
+ * n influences is stored n times, once in the range of each of its bones, as
+ * (x * w, y * w, z * w, w). The weight table then lists, for each influence
+ * count, how many vertices have it, padded to a qwc, followed by the raw
+ * vertex indices of each of them, a qwc aligned group per influence count.
+ * The strip nodes index the vertices of those groups, whose positions are
+ * the sum of their raw vertices transformed by their bones. Packets without a
+ * weight table, like ours, index the raw vertices directly.
+ */
+struct bar_header {
+    char magic[4];
+    unsigned int entry_cnt;
+    unsigned int res1;
+    unsigned int res2;
+};
+
+struct bar_entry {
+    unsigned short type;
+    unsigned short dup;
+    char name[4];
+    unsigned int off;
+    unsigned int size;
+};
+
+// glTF only has room for 4 influences per vertex
+#define EXPORT_INFLUENCES 4
+
+struct export_prim {
+    unsigned int texture_idx;
+    std::vector<float> pos;
+    std::vector<float> uv;
+    // EXPORT_INFLUENCES per vertex
+    std::vector<unsigned short> joints;
+    std::vector<float> weights;
+};
+
+// 4x4 matrices below are column major, as glTF wants them
+void mat4_mul(const float a[16], const float b[16], float out[16]) {
+    float r[16];
+    for (int c = 0; c < 4; c++) {
+        for (int l = 0; l < 4; l++) {
+            r[c * 4 + l] = 0;
+            for (int k = 0; k < 4; k++) {
+                r[c * 4 + l] += a[k * 4 + l] * b[c * 4 + k];
+            }
+        }
+    }
+    memcpy(out, r, sizeof(r));
+}
+
+// bones are scaled, then rotated around X, Y and Z, then translated
+void bone_matrix(const struct bone_entry *bone, float m[16]) {
+    float cx = cosf(bone->rot_x), sx = sinf(bone->rot_x);
+    float cy = cosf(bone->rot_y), sy = sinf(bone->rot_y);
+    float cz = cosf(bone->rot_z), sz = sinf(bone->rot_z);
+    float r[9] = { cz * cy,
+                   sz * cy,
+                   -sy,
+                   cz * sy * sx - sz * cx,
+                   sz * sy * sx + cz * cx,
+                   cy * sx,
+                   cz * sy * cx + sz * sx,
+                   sz * sy * cx - cz * sx,
+                   cy * cx };
+    float sca[3] = { bone->sca_x, bone->sca_y, bone->sca_z };
+    for (int c = 0; c < 3; c++) {
+        for (int l = 0; l < 3; l++) {
+            m[c * 4 + l] = r[c * 3 + l] * sca[c];
+        }
+        m[c * 4 + 3] = 0;
+    }
+    m[12] = bone->trans_x;
+    m[13] = bone->trans_y;
+    m[14] = bone->trans_z;
+    m[15] = 1;
+}
+
+void bone_quat(const struct bone_entry *bone, float q[4]) {
+    float cx = cosf(bone->rot_x / 2), sx = sinf(bone->rot_x / 2);
+    float cy = cosf(bone->rot_y / 2), sy = sinf(bone->rot_y / 2);
+    float cz = cosf(bone->rot_z / 2), sz = sinf(bone->rot_z / 2);
+    q[0] = sx * cy * cz - cx * sy * sz;
+    q[1] = cx * sy * cz + sx * cy * sz;
+    q[2] = cx * cy * sz - sx * sy * cz;
+    q[3] = cx * cy * cz + sx * sy * sz;
+}
+
+void mat4_inverse_affine(const float m[16], float out[16]) {
+    float a = m[0], b = m[4], c = m[8];
+    float d = m[1], e = m[5], f = m[9];
+    float g = m[2], h = m[6], i = m[10];
+    float det = a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+    float inv = det != 0 ? 1 / det : 0;
+    out[0] = (e * i - f * h) * inv;
+    out[4] = (c * h - b * i) * inv;
+    out[8] = (b * f - c * e) * inv;
+    out[1] = (f * g - d * i) * inv;
+    out[5] = (a * i - c * g) * inv;
+    out[9] = (c * d - a * f) * inv;
+    out[2] = (d * h - e * g) * inv;
+    out[6] = (b * g - a * h) * inv;
+    out[10] = (a * e - b * d) * inv;
+    for (int l = 0; l < 3; l++) {
+        out[12 + l] = -(out[l] * m[12] + out[4 + l] * m[13] +
+                        out[8 + l] * m[14]);
+        out[3 + l * 4] = 0;
+    }
+    out[15] = 1;
+}
+
+// a vertex once weighted and transformed by its bones
+struct export_vert {
+    float pos[3];
+    unsigned short joints[EXPORT_INFLUENCES];
+    float weights[EXPORT_INFLUENCES];
+};
+
+// adds the raw vertex p of weight w, transformed by bone, to vert. Only the
+// heaviest influences are kept when there are more than glTF can take
+void export_influence(struct export_vert *vert, const float p[4], int bone,
+                      const float bone_world[], int bone_cnt) {
+    if (bone < 0 || bone >= bone_cnt) {
+        for (int l = 0; l < 3; l++) {
+            vert->pos[l] += p[l];
+        }
+        return;
+    }
+    const float *m = &bone_world[bone * 16];
+    for (int l = 0; l < 3; l++) {
+        vert->pos[l] +=
+            m[l] * p[0] + m[4 + l] * p[1] + m[8 + l] * p[2] + m[12 + l] * p[3];
+    }
+    int k = 0;
+    for (; k < EXPORT_INFLUENCES; k++) {
+        if (vert->weights[k] == 0 || vert->joints[k] == bone) {
+            break;
+        }
+    }
+    if (k == EXPORT_INFLUENCES) {
+        k = 0;
+        for (int l = 1; l < EXPORT_INFLUENCES; l++) {
+            if (vert->weights[l] < vert->weights[k]) {
+                k = l;
+            }
+        }
+        if (vert->weights[k] >= p[3]) {
+            return;
+        }
+        vert->weights[k] = 0;
+    }
+    vert->joints[k] = bone;
+    vert->weights[k] += p[3];
+}
+
+// decodes one packet into prim, slot_bone maps the packet matrix slots to
+// bones
+int export_packet(const unsigned char *vif, size_t len, const int slot_bone[],
+                  int slot_max, const float bone_world[], int bone_cnt,
+                  struct export_prim *prim) {
+    unsigned int *vu =
+        (unsigned int *)calloc(VU1_QWC_MAX * 4, sizeof(unsigned int));
+    unsigned char fmt[VU1_QWC_MAX];
+    memset(fmt, 32, sizeof(fmt));
+    if (vif_run(vif, len, vu, fmt)) {
+        free(vu);
+        return -1;
+    }
+    struct vif_header hdr;
+    memcpy(&hdr, vu, sizeof(hdr));
+    if (!in_file(hdr.node_off, hdr.node_cnt, VU1_QWC_MAX) ||
+        !in_file(hdr.vert_off, hdr.vert_cnt, VU1_QWC_MAX) ||
+        !in_file((size_t)hdr.mat_cnt_off * 4, hdr.mat_cnt, VU1_QWC_MAX * 4) ||
+        !in_file((size_t)hdr.weight_off * 4, hdr.weight_cnt,
+                 VU1_QWC_MAX * 4)) {
+        free(vu);
+        return -1;
+    }
+    // quantized positions, as written by quantize_packet
+    int quant = hdr.vert_cnt && fmt[hdr.vert_off] == 16;
+    if (quant && (hdr.mat_off < QUANT_QWC || hdr.mat_off > VU1_QWC_MAX)) {
+        free(vu);
+        return -1;
+    }
+    const float *quant_scale =
+        (const float *)&vu[(hdr.mat_off - QUANT_QWC) * 4 * quant];
+    const float *quant_off =
+        (const float *)&vu[(hdr.mat_off - QUANT_QWC + 1) * 4 * quant];
+
+    // vertices are sorted per matrix slot, the header tells us how many
+    // each slot gets
+    std::vector<int> vert_bone(hdr.vert_cnt, -1);
+    unsigned int v = 0;
+    for (unsigned int s = 0; s < hdr.mat_cnt; s++) {
+        unsigned int cnt = vu[hdr.mat_cnt_off * 4 + s];
+        int bone = (int)s < slot_max ? slot_bone[s] : -1;
+        for (unsigned int k = 0; k < cnt && v < hdr.vert_cnt; k++) {
+            vert_bone[v++] = bone;
+        }
+    }
+    std::vector<float> raw(hdr.vert_cnt * 4);
+    for (v = 0; v < hdr.vert_cnt; v++) {
+        const unsigned int *src = &vu[(hdr.vert_off + v) * 4];
+        memcpy(&raw[v * 4], src, 4 * sizeof(float));
+        if (quant) {
+            for (int l = 0; l < 3; l++) {
+                raw[v * 4 + l] = (int)src[l] * quant_scale[l] + quant_off[l];
+            }
+        }
+        if (!hdr.weight_cnt || quant) {
+            raw[v * 4 + 3] = 1;
+        }
+    }
+
+    std::vector<export_vert> verts;
+    struct export_vert empty_vert;
+    memset(&empty_vert, 0, sizeof(empty_vert));
+    if (!hdr.weight_cnt) {
+        verts.resize(hdr.vert_cnt, empty_vert);
+        for (v = 0; v < hdr.vert_cnt; v++) {
+            export_influence(&verts[v], &raw[v * 4], vert_bone[v], bone_world,
+                             bone_cnt);
+        }
+    } else {
+        size_t word = (size_t)hdr.weight_off * 4;
+        size_t pos = (word + hdr.weight_cnt + 3) & ~(size_t)3;
+        for (unsigned int g = 0; g < hdr.weight_cnt; g++) {
+            unsigned int cnt = vu[word + g];
+            if (!in_file(pos, (size_t)cnt * (g + 1), VU1_QWC_MAX * 4)) {
+                free(vu);
+                return -1;
+            }
+            for (unsigned int e = 0; e < cnt; e++) {
+                struct export_vert vert = empty_vert;
+                for (unsigned int k = 0; k <= g; k++) {
+                    unsigned int r = vu[pos++];
+                    if (r >= hdr.vert_cnt) {
+                        free(vu);
+                        return -1;
+                    }
+                    export_influence(&vert, &raw[r * 4], vert_bone[r],
+                                     bone_world, bone_cnt);
+                }
+                verts.push_back(vert);
+            }
+            pos = (pos + 3) & ~(size_t)3;
+        }
+    }
+    for (size_t o = 0; o < verts.size(); o++) {
+        float sum = 0;
+        for (int k = 0; k < EXPORT_INFLUENCES; k++) {
+            sum += verts[o].weights[k];
+        }
+        for (int k = 0; k < EXPORT_INFLUENCES; k++) {
+            verts[o].weights[k] = sum > 0 ? verts[o].weights[k] / sum : 0;
+        }
+        if (sum <= 0) {
+            verts[o].weights[0] = 1;
+        }
+    }
+
+    unsigned int ring[3] = { 0, 0, 0 };
+    float ring_uv[3][2] = { { 0, 0 }, { 0, 0 }, { 0, 0 } };
+    for (unsigned int n = 0; n < hdr.node_cnt; n++) {
+        const unsigned int *node = &vu[(hdr.node_off + n) * 4];
+        unsigned int idx = node[2];
+        if (idx >= verts.size()) {
+            free(vu);
+            return -1;
+        }
+        ring[0] = ring[1];
+        ring[1] = ring[2];
+        ring[2] = idx;
+        memcpy(ring_uv[0], ring_uv[1], sizeof(ring_uv[0]));
+        memcpy(ring_uv[1], ring_uv[2], sizeof(ring_uv[0]));
+        ring_uv[2][0] = (short)node[0] / 4096.0f;
+        ring_uv[2][1] = (short)node[1] / 4096.0f;
+
+        // 0x10 only pushes the vertex in the strip, 0x30 draws the triangle
+        // the other way around
+        unsigned int func = node[3] & 0xF0;
+        if (func == 0x10 || n < 2) {
+            continue;
+        }
+        int order[3] = { 0, 1, 2 };
+        if (func == 0x30) {
+            order[0] = 1;
+            order[1] = 0;
+        }
+        for (int k = 0; k < 3; k++) {
+            const struct export_vert &vert = verts[ring[order[k]]];
+            prim->pos.insert(prim->pos.end(), vert.pos, vert.pos + 3);
+            prim->uv.push_back(ring_uv[order[k]][0]);
+            prim->uv.push_back(ring_uv[order[k]][1]);
+            prim->joints.insert(prim->joints.end(), vert.joints,
+                                vert.joints + EXPORT_INFLUENCES);
+            prim->weights.insert(prim->weights.end(), vert.weights,
+                                 vert.weights + EXPORT_INFLUENCES);
+        }
+    }
+    free(vu);
+    return 0;
+}
+
+int write_gltf(const char *base, const struct bone_entry *bones, int bone_cnt,
+               const float bone_world[], std::vector<export_prim> &prims) {
+    std::string gltfname = std::string(base) + ".gltf";
+    std::string binname = std::string(base) + ".bin";
+    std::string binuri = binname.substr(binname.find_last_of('/') + 1);
+    FILE *bin = fopen(binname.c_str(), "wb");
+    FILE *gltf = fopen(gltfname.c_str(), "w");
+    if (!bin || !gltf) {
+        printf("error: can't write %s\n", gltfname.c_str());
+        if (bin) {
+            fclose(bin);
+        }
+        if (gltf) {
+            fclose(gltf);
+        }
+        return -1;
+    }
+
+    // one buffer view and accessor per attribute, in the order we write them
+    std::string views, accessors, meshes;
+    unsigned int view_nmb = 0;
+    long bin_off = 0;
+    unsigned int texture_max = 0;
+    char tmp[512];
+    for (size_t i = 0; i < prims.size(); i++) {
+        const struct export_prim &prim = prims[i];
+        size_t vert_nmb = prim.pos.size() / 3;
+        if (vert_nmb == 0) {
+            continue;
+        }
+        float min[3] = { prim.pos[0], prim.pos[1], prim.pos[2] };
+        float max[3] = { prim.pos[0], prim.pos[1], prim.pos[2] };
+        for (size_t v = 0; v < vert_nmb; v++) {
+            for (int k = 0; k < 3; k++) {
+                min[k] = fminf(min[k], prim.pos[v * 3 + k]);
+                max[k] = fmaxf(max[k], prim.pos[v * 3 + k]);
+            }
+        }
+        const void *data[4] = { prim.pos.data(), prim.uv.data(),
+                                prim.joints.data(), prim.weights.data() };
+        size_t stride[4] = { 12, 8, 8, 16 };
+        const char *type[4] = { "VEC3", "VEC2", "VEC4", "VEC4" };
+        int comp[4] = { 5126, 5126, 5123, 5126 };
+        for (int a = 0; a < 4; a++) {
+            if (a == 2 && bone_cnt == 0) {
+                break;
+            }
+            fwrite(data[a], 1, stride[a] * vert_nmb, bin);
+            snprintf(tmp, sizeof(tmp),
+                     "%s{\"buffer\":0,\"byteOffset\":%ld,\"byteLength\":%zu}",
+                     view_nmb ? "," : "", bin_off, stride[a] * vert_nmb);
+            views += tmp;
+            snprintf(tmp, sizeof(tmp),
+                     "%s{\"bufferView\":%u,\"componentType\":%d,"
+                     "\"count\":%zu,\"type\":\"%s\"",
+                     view_nmb ? "," : "", view_nmb, comp[a], vert_nmb,
+                     type[a]);
+            accessors += tmp;
+            if (a == 0) {
+                snprintf(tmp, sizeof(tmp),
+                         ",\"min\":[%.9g,%.9g,%.9g],\"max\":[%.9g,%.9g,%.9g]",
+                         min[0], min[1], min[2], max[0], max[1], max[2]);
+                accessors += tmp;
+            }
+            accessors += "}";
+            bin_off += stride[a] * vert_nmb;
+            view_nmb++;
+        }
+        if (bone_cnt) {
+            snprintf(tmp, sizeof(tmp),
+                     "%s{\"attributes\":{\"POSITION\":%u,\"TEXCOORD_0\":%u,"
+                     "\"JOINTS_0\":%u,\"WEIGHTS_0\":%u},\"material\":%u}",
+                     meshes.empty() ? "" : ",", view_nmb - 4, view_nmb - 3,
+                     view_nmb - 2, view_nmb - 1, prim.texture_idx);
+        } else {
+            snprintf(tmp, sizeof(tmp),
+                     "%s{\"attributes\":{\"POSITION\":%u,\"TEXCOORD_0\":%u},"
+                     "\"material\":%u}",
+                     meshes.empty() ? "" : ",", view_nmb - 2, view_nmb - 1,
+                     prim.texture_idx);
+        }
+        meshes += tmp;
+        if (prim.texture_idx + 1 > texture_max) {
+            texture_max = prim.texture_idx + 1;
+        }
+    }
+
+    if (bone_cnt) {
+        for (int b = 0; b < bone_cnt; b++) {
+            float inv[16];
+            mat4_inverse_affine(&bone_world[b * 16], inv);
+            fwrite(inv, 1, sizeof(inv), bin);
+        }
+        snprintf(tmp, sizeof(tmp),
+                 "%s{\"buffer\":0,\"byteOffset\":%ld,\"byteLength\":%d}",
+                 view_nmb ? "," : "", bin_off, bone_cnt * 64);
+        views += tmp;
+        snprintf(tmp, sizeof(tmp),
+                 "%s{\"bufferView\":%u,\"componentType\":5126,"
+                 "\"count\":%d,\"type\":\"MAT4\"}",
+                 view_nmb ? "," : "", view_nmb, bone_cnt);
+        accessors += tmp;
+        bin_off += bone_cnt * 64;
+        view_nmb++;
+    }
+
+    fprintf(gltf, "{\"asset\":{\"version\":\"2.0\",\"generator\":"
+                  "\"kh2mdlx\"},\n\"scene\":0,\n\"scenes\":[{\"nodes\":[");
+    int first = 1;
+    for (int b = 0; b < bone_cnt; b++) {
+        if (bones[b].parent < 0 || bones[b].parent >= b) {
+            fprintf(gltf, "%s%d", first ? "" : ",", b);
+            first = 0;
+        }
+    }
+    fprintf(gltf, "%s%d]}],\n\"nodes\":[", first ? "" : ",", bone_cnt);
+    for (int b = 0; b < bone_cnt; b++) {
+        float q[4];
+        bone_quat(&bones[b], q);
+        fprintf(gltf,
+                "{\"name\":\"bone%d\",\"translation\":[%.9g,%.9g,%.9g],"
+                "\"rotation\":[%.9g,%.9g,%.9g,%.9g],"
+                "\"scale\":[%.9g,%.9g,%.9g]",
+                b, bones[b].trans_x, bones[b].trans_y, bones[b].trans_z, q[0],
+                q[1], q[2], q[3], bones[b].sca_x, bones[b].sca_y,
+                bones[b].sca_z);
+        first = 1;
+        for (int c = 0; c < bone_cnt; c++) {
+            if (bones[c].parent == b && c > b) {
+                fprintf(gltf, "%s%d", first ? ",\"children\":[" : ",", c);
+                first = 0;
+            }
+        }
+        fprintf(gltf, "%s},\n", first ? "" : "]");
+    }
+    fprintf(gltf, "{\"name\":\"model\",\"mesh\":0%s}],\n",
+            bone_cnt ? ",\"skin\":0" : "");
+    if (bone_cnt) {
+        fprintf(gltf, "\"skins\":[{\"inverseBindMatrices\":%u,\"joints\":[",
+                view_nmb - 1);
+        for (int b = 0; b < bone_cnt; b++) {
+            fprintf(gltf, "%s%d", b ? "," : "", b);
+        }
+        fprintf(gltf, "]}],\n");
+    }
+    fprintf(gltf, "\"materials\":[");
+    for (unsigned int t = 0; t < texture_max; t++) {
+        fprintf(gltf, "%s{\"name\":\"texture%u\"}", t ? "," : "", t);
+    }
+    fprintf(gltf, "],\n\"meshes\":[{\"primitives\":[%s]}],\n", meshes.c_str());
+    fprintf(gltf, "\"accessors\":[%s],\n", accessors.c_str());
+    fprintf(gltf, "\"bufferViews\":[%s],\n", views.c_str());
+    fprintf(gltf, "\"buffers\":[{\"uri\":\"%s\",\"byteLength\":%ld}]}\n",
+            binuri.c_str(), bin_off);
+    fclose(gltf);
+    fclose(bin);
+    return 0;
+}
+
+// exports the model held in the bytes at mdl, as found after the 0x90 bytes
+// in-game header
+int export_mdl(const unsigned char *mdl, size_t size, const char *base) {
+    if (!in_file(0, sizeof(struct mdl_header), size)) {
+        printf("error: %s: truncated model header\n", base);
+        return -1;
+    }
+    const struct mdl_header *head = (const struct mdl_header *)mdl;
+    int bone_cnt = head->bone_cnt;
+    if (head->nmb != 3 ||
+        !in_file(head->bone_off, bone_cnt * sizeof(struct bone_entry), size) ||
+        !in_file(sizeof(struct mdl_header),
+                 head->mdl_subpart_cnt * sizeof(struct mdl_subpart_header),
+                 size)) {
+        printf("error: %s: not a model we know of\n", base);
+        return -1;
+    }
+    const struct bone_entry *bones =
+        (const struct bone_entry *)(mdl + head->bone_off);
+
+    // parents always come before their children in the bone table
+    std::vector<float> bone_world(bone_cnt * 16 + 1);
+    for (int b = 0; b < bone_cnt; b++) {
+        bone_matrix(&bones[b], &bone_world[b * 16]);
+        if (bones[b].parent >= 0 && bones[b].parent < b) {
+            mat4_mul(&bone_world[bones[b].parent * 16], &bone_world[b * 16],
+                     &bone_world[b * 16]);
+        }
+    }
+
+    std::vector<export_prim> prims(head->mdl_subpart_cnt);
+    const struct mdl_subpart_header *subparts =
+        (const struct mdl_subpart_header *)(mdl + sizeof(struct mdl_header));
+    for (int i = 0; i < head->mdl_subpart_cnt; i++) {
+        const struct mdl_subpart_header *sub = &subparts[i];
+        prims[i].texture_idx = sub->texture_idx;
+        if (!in_file(sub->DMA_off, (size_t)sub->DMA_size * 16, size) ||
+            !in_file(sub->mat_off, 4, size)) {
+            printf("error: %s: MP %d is out of the file\n", base, i + 1);
+            return -1;
+        }
+        const int *mat = (const int *)(mdl + sub->mat_off) + 1;
+        size_t mat_left = (size - sub->mat_off) / 4 - 1;
+
+        // matrices stay resident in their half of the VU1 double buffer
+        // across packets, see mat_cache
+        int slot_bone[2][VU1_QWC_MAX / 4];
+        for (int k = 0; k < VU1_QWC_MAX / 4; k++) {
+            slot_bone[0][k] = -1;
+            slot_bone[1][k] = -1;
+        }
+        int vifpkt = 0;
+        const unsigned char *pkt = NULL;
+        size_t pkt_len = 0;
+        unsigned int pkt_mat_off = 0;
+        for (unsigned int d = 0; d <= sub->DMA_size; d++) {
+            const struct DMA *tag =
+                d < sub->DMA_size
+                    ? (const struct DMA *)(mdl + sub->DMA_off + d * 16)
+                    : NULL;
+            // the VIF codes right after the tag, the sentinel has none
+            const unsigned char *tag_vif =
+                tag ? (const unsigned char *)(tag + 1) : NULL;
+            int is_mat =
+                tag_vif && tag->vif_len == 4 && (tag_vif[7] & 0x60) == 0x60;
+            if (is_mat && pkt) {
+                unsigned int addr = tag_vif[4] | ((tag_vif[5] & 0x3) << 8);
+                unsigned int slot = (addr - pkt_mat_off) / 4;
+                if (mat_left == 0 || slot >= VU1_QWC_MAX / 4) {
+                    printf("error: %s: MP %d has a broken mat table\n", base,
+                           i + 1);
+                    return -1;
+                }
+                slot_bone[vifpkt % 2][slot] = *mat++;
+                mat_left--;
+                continue;
+            }
+            // anything else ends the previous packet
+            if (pkt) {
+                if (export_packet(pkt, pkt_len, slot_bone[vifpkt % 2],
+                                  VU1_QWC_MAX / 4, bone_world.data(), bone_cnt,
+                                  &prims[i])) {
+                    printf("error: %s: MP %d packet %d can't be decoded\n",
+                           base, i + 1, vifpkt);
+                    return -1;
+                }
+                pkt = NULL;
+                // skip the packet end marker
+                if (mat_left) {
+                    mat++;
+                    mat_left--;
+                }
+            }
+            if (tag && tag->vif_len != 0 && (tag->res1 & 0x7000) == 0x3000) {
+                pkt_len = tag->vif_len * 16;
+                if (!in_file(tag->vif_off, pkt_len, size) || pkt_len < 0x48) {
+                    printf("error: %s: MP %d packet is out of the file\n",
+                           base, i + 1);
+                    return -1;
+                }
+                pkt = mdl + tag->vif_off;
+                // the header starts right after the first two VIF codes
+                memcpy(&pkt_mat_off, pkt + 0x24, sizeof(pkt_mat_off));
+                vifpkt++;
+            }
+        }
+    }
+    return write_gltf(base, bones, bone_cnt, bone_world.data(), prims);
+}
+
+int export_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        printf("error: can't open %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t size = st.st_size;
+    const unsigned char *file = (const unsigned char *)mmap(
+        NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        printf("error: can't map %s\n", path);
+        return -1;
+    }
+    madvise((void *)file, size, MADV_SEQUENTIAL);
+
+    std::string base =
+        std::string(path).substr(0, std::string(path).find_last_of('.'));
+    size_t off = 0, len = size;
+    // either a whole BAR or a model as we write it
+    if (size >= sizeof(struct bar_header) && memcmp(file, "BAR\x01", 4) == 0) {
+        const struct bar_header *bar = (const struct bar_header *)file;
+        len = 0;
+        for (unsigned int i = 0; i < bar->entry_cnt; i++) {
+            size_t e_off = sizeof(struct bar_header) + i * sizeof(bar_entry);
+            if (!in_file(e_off, sizeof(struct bar_entry), size)) {
+                break;
+            }
+            const struct bar_entry *e =
+                (const struct bar_entry *)(file + e_off);
+            if (e->type == 0x04 && in_file(e->off, e->size, size)) {
+                off = e->off;
+                len = e->size;
+                break;
+            }
+        }
+    }
+    int ret = -1;
+    if (len <= 0x90) {
+        printf("error: %s has no model\n", path);
+    } else {
+        ret = export_mdl(file + off + 0x90, len - 0x90, base.c_str());
+    }
+    munmap((void *)file, size);
+    if (!ret) {
+        printf("Exported %s.gltf\n", base.c_str());
+    }
+    return ret;
+}
+
+// every file is independent from the others, so we just have a worker per
+// core pull the next one until there's none left
+int export_batch(int file_nmb, char *files[]) {
+    std::atomic<int> next(0);
+    std::atomic<int> failed(0);
+    unsigned int worker_nmb = std::thread::hardware_concurrency();
+    if (worker_nmb == 0) {
+        worker_nmb = 1;
+    }
+    if (worker_nmb > (unsigned int)file_nmb) {
+        worker_nmb = file_nmb;
+    }
+    std::vector<std::thread> workers;
+    for (unsigned int w = 0; w < worker_nmb; w++) {
+        workers.push_back(std::thread([&]() {
+            int i;
+            while ((i = next++) < file_nmb) {
+                if (export_file(files[i])) {
+                    failed++;
+                }
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); w++) {
+        workers[w].join();
+    }
+    printf("Exported %d models, %d failed\n", file_nmb - failed.load(),
+           failed.load());
+    return failed ? -1 : 0;
+}
+
 int main(int argc, char *argv[]) {
     printf("kh2mdlx\n--- Early rev, don't blame me if it eats your cat\n\n");
-    if (argc < 2) {
-        printf("usage: kh2mdlx model.dae\n");
+    int opt;
+    int export_mode = 0;
+    int quantize = 0;
+    int optimize = 0;
+    int resident = 0;
+    char *coll_name = NULL;
+    while ((opt = getopt(argc, argv, "xqrOc:")) != -1) {
+        switch (opt) {
+        case 'x':
+            export_mode = 1;
+            break;
+        case 'q':
+            quantize = 1;
+            break;
+        case 'r':
+            resident = 1;
+            break;
+        case 'O':
+            optimize = 1;
+            break;
+        case 'c':
+            coll_name = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        printf("usage: kh2mdlx [-q] [-r] [-O] [-c collision.dae] model.dae\n"
+               "       kh2mdlx -x model.mdlx [model.mdlx...]\n");
         return -1;
     }
+    if (export_mode) {
+        return export_batch(argc - optind, argv + optind);
+    }
+    char *name = argv[optind];
 
     FILE *mdl;
     char empty[] = { 0x00 };
 
     std::string kh2mname =
-        std::string(argv[1]).substr(0, std::string(argv[1]).find_last_of('.')) +
+        std::string(name).substr(0, std::string(name).find_last_of('.')) +
         ".kh2m";
     mdl = fopen(kh2mname.c_str(), "wb");
 
@@ -376,8 +2331,8 @@ int main(int argc, char *argv[]) {
         aiComponent_NORMALS | aiComponent_TANGENTS_AND_BITANGENTS |
             aiComponent_COLORS | aiComponent_LIGHTS | aiComponent_CAMERAS);
     const aiScene *scene = importer.ReadFile(
-        argv[1], aiProcess_Triangulate | aiProcess_RemoveComponent |
-                     aiProcess_JoinIdenticalVertices | aiProcess_SortByPType);
+        name, aiProcess_Triangulate | aiProcess_RemoveComponent |
+                  aiProcess_JoinIdenticalVertices | aiProcess_SortByPType);
     if (!scene) {
         printf("error loading model!: %s", importer.GetErrorString());
         return -1;
@@ -431,17 +2386,12 @@ int main(int argc, char *argv[]) {
     exporter.Export(scene, "fbx", "test.fbx", scene->mFlags);*/
 
     unsigned int mesh_nmb = scene->mNumMeshes;
-    int vifpkt[mesh_nmb];
     printf("Number of meshes: %d\n", mesh_nmb);
     int bones_prec[mesh_nmb];
-    int mat_entries[mesh_nmb];
-    int dma_entries[mesh_nmb];
-    for (unsigned int z = 0; z < mesh_nmb; z++) {
-        mat_entries[z] = 0;
-    }
-    for (unsigned int z = 0; z < mesh_nmb; z++) {
-        dma_entries[z] = 0;
-    }
+    // one part per mesh, the one of its best build
+    unsigned int part_nmb = mesh_nmb;
+    struct mdl_part *parts =
+        (mdl_part *)malloc(part_nmb * sizeof(struct mdl_part));
     for (unsigned int z = 0; z < mesh_nmb; z++) {
         if (z == 0) {
             bones_prec[z] = 0;
@@ -450,142 +2400,128 @@ int main(int argc, char *argv[]) {
             bones_prec[z] = (mesh.mNumBones) + bones_prec[z - 1];
         }
     }
+    int bones_nmb = 0;
     for (unsigned int i = 0; i < mesh_nmb; i++) {
-
-        vifpkt[i] = 1;
-        int vert_count = 0;
-        int face_count = 0;
-        int bone_count = 0;
         const aiMesh &mesh = *scene->mMeshes[i];
-        // for some reason those arrays aren't initialized as 0...?
-        unsigned int vertices_drawn[mesh.mNumVertices];
-        for (unsigned int z = 0; z < mesh.mNumVertices; z++) {
-            vertices_drawn[z] = 0;
-        }
-        unsigned int bones_drawn[mesh.mNumBones];
-        for (unsigned int z = 0; z < mesh.mNumBones; z++) {
-            bones_drawn[z] = 0;
-        }
-        int faces_drawn[mesh.mNumFaces];
-        for (unsigned int z = 0; z < mesh.mNumFaces; z++) {
-            faces_drawn[z] = 0;
-        }
-        printf("Bone for MP %d : %d\n", i + 1, mesh.mNumBones);
-
-        // we are writing a custom interlaced, bone-supporting obj here,
-        // don't assume everything is following the obj standard!
-        // printf("Generating Model Part %d, packet %d\n", i+1, vifpkt);
-        for (unsigned int y = 0; y < mesh.mNumFaces; y++) {
-
-            // we make the biggest vif packet, possible, for this, here
-            // is the size that each type of entry takes:
-            //
-            // header - 4 qwc
-            // bones - 1/4 of a qwc + 4 qwc(DMA tags)
-            // vertices - 1 qwc
-            // Face drawing - 3 qwc, UV and flags are bundled with it
-            // we here take the worst case scenario to ensure the vif
-            // packet < the maximum size
-            if (((((ceil((bone_count + 3) / 4) + (4 * (bone_count + 3))) +
-                   (vert_count + 3) + ((face_count + 1) * 3)) +
-                  4) < 100)) {
-                // we update faces
-                faces_drawn[face_count] = y;
-                face_count++;
-                // we update bones
-                // printf("This face has the vertices %d %d
-                // %d\n",mesh.mFaces[y].mIndices[0],mesh.mFaces[y].mIndices[1],
-                // mesh.mFaces[y].mIndices[2]);
-                int tmp_check = 0;
-                for (unsigned int d = 0; d < mesh.mNumBones; d++) {
-                    for (unsigned int e = 0; e < mesh.mBones[d]->mNumWeights;
-                         e++) {
-                        tmp_check = 0;
-                        if (mesh.mBones[d]->mWeights[e].mVertexId ==
-                                mesh.mFaces[y].mIndices[0] ||
-                            mesh.mBones[d]->mWeights[e].mVertexId ==
-                                mesh.mFaces[y].mIndices[1] ||
-                            mesh.mBones[d]->mWeights[e].mVertexId ==
-                                mesh.mFaces[y].mIndices[2]) {
-                            for (int f = 0; f < bone_count; f++) {
-                                if (bones_drawn[f] == d) {
-                                    tmp_check = 1;
-                                }
-                            }
-                            // if we find a vertex of this face
-                            // associated to any bone and it is not a
-                            // duplicate we add it
-                            if (tmp_check == 0) {
-                                bones_drawn[bone_count] = d;
-                                bone_count++;
-                            }
-                        }
-                    }
-                }
-                tmp_check = 0;
-                // we update vertices
-                for (int d = 0; d < vert_count; d++) {
-                    if (vertices_drawn[d] == mesh.mFaces[y].mIndices[0]) {
-                        tmp_check = 1;
-                    }
-                }
-                if (tmp_check == 0) {
-                    vertices_drawn[vert_count] = mesh.mFaces[y].mIndices[0];
-                    vert_count++;
-                }
-                tmp_check = 0;
-                for (int d = 0; d < vert_count; d++) {
-                    if (vertices_drawn[d] == mesh.mFaces[y].mIndices[1]) {
-                        tmp_check = 1;
-                    }
-                }
-                if (tmp_check == 0) {
-                    vertices_drawn[vert_count] = mesh.mFaces[y].mIndices[1];
-                    vert_count++;
-                }
-                tmp_check = 0;
-                for (int d = 0; d < vert_count; d++) {
-                    if (vertices_drawn[d] == mesh.mFaces[y].mIndices[2]) {
-                        tmp_check = 1;
-                    }
-                }
-                if (tmp_check == 0) {
-                    vertices_drawn[vert_count] = mesh.mFaces[y].mIndices[2];
-                    vert_count++;
-                }
-
-                if (y == mesh.mNumFaces - 1) {
-                    write_packet(vert_count, bone_count, face_count,
-                                 bones_drawn, faces_drawn, vertices_drawn,
-                                 i + 1, vifpkt[i], mesh, argv[1], 1, bones_prec,
-                                 mat_entries, dma_entries);
-                }
+        bones_nmb += mesh.mNumBones;
+    }
+    if (bones_nmb > MDL_U16_MAX) {
+        printf("error: %d bones, a model can only hold %d\n", bones_nmb,
+               MDL_U16_MAX);
+        return -1;
+    }
+    // every mesh gets built once per budget and strategy we try, all of them
+    // in parallel, and we keep the best build of each
+    int budget_min = optimize ? PKT_BUDGET_MIN : PKT_BUDGET;
+    int strategy_nmb = optimize ? STRATEGY_NMB : 1;
+    std::vector<mesh_build> builds;
+    for (unsigned int i = 0; i < mesh_nmb; i++) {
+        for (int b = PKT_BUDGET; b >= budget_min; b -= PKT_BUDGET_STEP) {
+            for (int s = 0; s < strategy_nmb; s++) {
+                struct mesh_build build;
+                memset(&build, 0, sizeof(build));
+                build.mesh = i;
+                build.pkt_budget = b;
+                build.strategy = s;
+                build.quiet = optimize;
+                build.prefix = (char *)malloc(PATH_MAX * sizeof(char));
+                snprintf(build.prefix, PATH_MAX, "%s_m%d_c%zu", name, i + 1,
+                         builds.size());
+                builds.push_back(build);
+            }
+        }
+    }
+    std::atomic<size_t> next(0);
+    unsigned int worker_nmb = std::thread::hardware_concurrency();
+    if (worker_nmb == 0) {
+        worker_nmb = 1;
+    }
+    std::vector<std::thread> workers;
+    for (unsigned int w = 0; w < worker_nmb && w < builds.size(); w++) {
+        workers.push_back(std::thread([&]() {
+            size_t b;
+            while ((b = next++) < builds.size()) {
+                build_mesh(*scene->mMeshes[builds[b].mesh],
+                           bones_prec[builds[b].mesh], quantize, resident,
+                           &builds[b]);
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); w++) {
+        workers[w].join();
+    }
 
-            } else {
-                write_packet(vert_count, bone_count, face_count, bones_drawn,
-                             faces_drawn, vertices_drawn, i + 1, vifpkt[i],
-                             mesh, argv[1], 0, bones_prec, mat_entries,
-                             dma_entries);
-                y--;
-                vifpkt[i]++;
-                face_count = 0;
-                bone_count = 0;
-                vert_count = 0;
-                for (unsigned int z = 0; z < mesh.mNumVertices; z++) {
-                    vertices_drawn[z] = 0;
-                }
-                for (unsigned int z = 0; z < mesh.mNumBones; z++) {
-                    bones_drawn[z] = 0;
-                }
-                for (unsigned int z = 0; z < mesh.mNumFaces; z++) {
-                    faces_drawn[z] = 0;
+    // a build costs what it takes in the file plus the matrices it uploads
+    // each time it is drawn
+    int mat_uploads = 0;
+    int mat_skipped = 0;
+    for (unsigned int i = 0; i < mesh_nmb; i++) {
+        struct mesh_build *best = NULL;
+        int cand_nmb = 0;
+        for (size_t b = 0; b < builds.size(); b++) {
+            struct mesh_build *build = &builds[b];
+            if (build->mesh != i) {
+                continue;
+            }
+            if (build->ret) {
+                if (build->quiet) {
+                    printf("Mesh %d: budget %d qwc, %s order doesn't fit\n",
+                           i + 1, build->pkt_budget,
+                           strategy_names[build->strategy]);
                 }
-                // printf("Generating Model Part %d, packet %d\n", i+1, vifpkt);
+                continue;
+            }
+            cand_nmb++;
+            long cost = build->size + build->mat_uploads * 4 * 16;
+            long best_cost =
+                best ? best->size + best->mat_uploads * 4 * 16 : 0;
+            if (!best || cost < best_cost ||
+                (cost == best_cost && build->dma_entries < best->dma_entries)) {
+                best = build;
+            }
+        }
+        if (!best) {
+            printf("error: mesh %d doesn't fit in any packet budget\n", i + 1);
+            for (size_t b = 0; b < builds.size(); b++) {
+                mesh_build_files(&builds[b], NULL);
             }
-            // fclose(pkt);
+            return -1;
         }
+        printf("Mesh %d: budget %d qwc, %s order, %ld bytes, %d DMA entries, "
+               "%d matrix uploads, %d kept resident, best of %d builds\n",
+               i + 1, best->pkt_budget, strategy_names[best->strategy],
+               best->size, best->dma_entries, best->mat_uploads,
+               best->mat_skipped, cand_nmb);
+        mesh_build_files(best, name);
         printf("Generated Model Part %d, splitted in %d packets\n", i + 1,
-               vifpkt[i]);
+               best->part.vifpkt);
+        parts[i] = best->part;
+        mat_uploads += best->mat_uploads;
+        mat_skipped += best->mat_skipped;
+        // its files are gone, there's nothing left to remove
+        best->part.vifpkt = 0;
+    }
+    for (size_t b = 0; b < builds.size(); b++) {
+        mesh_build_files(&builds[b], NULL);
+        free(builds[b].prefix);
+    }
+
+    // each skipped upload saves a 4 qwc matrix, its DMA tag and its mat entry
+    printf("Matrix uploads: %d, skipped: %d, %d matrix bytes saved (%d bytes "
+           "total)\n",
+           mat_uploads, mat_skipped, mat_skipped * 4 * 16,
+           mat_skipped * (4 * 16 + 16 + 4));
+    for (unsigned int i = 0; quantize && i < part_nmb; i++) {
+        printf("Quantized MP %d: scale (%g, %g, %g), max error %f, %ld bytes "
+               "saved\n",
+               i + 1, parts[i].quant_scale[0], parts[i].quant_scale[1],
+               parts[i].quant_scale[2], parts[i].quant_err,
+               parts[i].quant_saved);
+    }
+    if (part_nmb > MDL_U16_MAX) {
+        printf("error: %d model parts, a model can only hold %d\n", part_nmb,
+               MDL_U16_MAX);
+        return -1;
     }
 
     // now that we have all intermediate files we can finally begin creating
@@ -594,13 +2530,6 @@ int main(int argc, char *argv[]) {
     for (int i = 0; i < 0x90; i++) {
         fwrite(empty, 1, sizeof(empty), mdl);
     }
-    int bones_nmb = 0;
-    for (unsigned int i = 0; i < mesh_nmb; i++) {
-        const aiMesh &mesh = *scene->mMeshes[i];
-        bones_nmb += mesh.mNumBones;
-    }
-
-    unsigned int subp_off[mesh_nmb];
     unsigned int mph = ftell(mdl);
     struct mdl_header *head = (mdl_header *)malloc(sizeof(struct mdl_header));
     head->nmb = 3;
@@ -615,19 +2544,19 @@ int main(int argc, char *argv[]) {
     // as this table is unused nobody cares and we blank it out, saves
     // space
     head->unk_off = 0;
-    head->mdl_subpart_cnt = mesh_nmb;
+    head->mdl_subpart_cnt = part_nmb;
     head->unk2 = 0;
     fwrite(head, 1, sizeof(struct mdl_header), mdl);
 
-    for (unsigned int y = 0; y < mesh_nmb; y++) {
+    for (unsigned int y = 0; y < part_nmb; y++) {
         // write subheader here!
-        subp_off[y] = ftell(mdl);
+        parts[y].subp_off = ftell(mdl);
         struct mdl_subpart_header *subhead =
             (mdl_subpart_header *)malloc(sizeof(struct mdl_subpart_header));
         // TODO: verify what those unknowns are!
         // we do not have any offset yet so we just blank out everything
         subhead->unk1 = 0;
-        // subhead->texture_idx = y;
+        // subhead->texture_idx = parts[y].mesh;
         subhead->texture_idx = 0;
         subhead->unk2 = 0;
         subhead->unk3 = 0;
@@ -644,33 +2573,50 @@ int main(int argc, char *argv[]) {
     fwrite(head, 1, sizeof(struct mdl_header), mdl);
     fseek(mdl, cur_pos, SEEK_SET);
 
-    unsigned char stupid_table[] __attribute__((aligned(16))) = {
-        0x3c, 0xa6, 0x95, 0xc2, 0xdd, 0x6e, 0xcf, 0x42, 0xa7, 0x94, 0x6b, 0xc2,
-        0x00, 0x00, 0x80, 0x3f, 0x9a, 0x98, 0x32, 0xc2, 0x18, 0x90, 0xe0, 0x42,
-        0x68, 0xc1, 0x96, 0x42, 0x00, 0x00, 0x80, 0x3f, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xa3, 0xec, 0x9b, 0x42,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    };
-    fwrite(stupid_table, 1, sizeof(stupid_table), mdl);
+    // the bounds of the whole model, the game culls it with them. We don't
+    // know what the rest of the table is, so it's kept as we found it in the
+    // models we lifted it from
+    struct mdl_bounds *bounds =
+        (mdl_bounds *)malloc(sizeof(struct mdl_bounds));
+    memset(bounds, 0, sizeof(struct mdl_bounds));
+    memset(bounds->unk1, 0xFF, sizeof(bounds->unk1));
+    bounds->unk2 = 77.962181f;
+    for (int k = 0; k < 4; k++) {
+        bounds->min[k] = INFINITY;
+        bounds->max[k] = -INFINITY;
+    }
+    for (unsigned int i = 0; i < mesh_nmb; i++) {
+        const aiMesh &mesh = *scene->mMeshes[i];
+        float min[4], max[4];
+        vertex_bounds(mesh.mVertices, mesh.mNumVertices, NULL,
+                      mesh.mNumVertices, min, max);
+        printf("Bounds for mesh %d: (%f, %f, %f) (%f, %f, %f)\n", i + 1,
+               min[0], min[1], min[2], max[0], max[1], max[2]);
+        for (int k = 0; k < 3; k++) {
+            bounds->min[k] = fminf(bounds->min[k], min[k]);
+            bounds->max[k] = fmaxf(bounds->max[k], max[k]);
+        }
+        // there is no room for those in the format, they're only printed
+        for (unsigned int y = 0; y < mesh.mNumBones; y++) {
+            const aiBone &bone = *mesh.mBones[y];
+            unsigned int idx[bone.mNumWeights + 1];
+            for (unsigned int w = 0; w < bone.mNumWeights; w++) {
+                idx[w] = bone.mWeights[w].mVertexId;
+            }
+            vertex_bounds(mesh.mVertices, bone.mNumWeights, idx,
+                          mesh.mNumVertices, min, max);
+            printf("Bounds for bone %d: (%f, %f, %f) (%f, %f, %f)\n",
+                   y + bones_prec[i], min[0], min[1], min[2], max[0], max[1],
+                   max[2]);
+        }
+    }
+    if (bounds->min[0] > bounds->max[0]) {
+        memset(bounds->min, 0, sizeof(bounds->min));
+        memset(bounds->max, 0, sizeof(bounds->max));
+    }
+    bounds->min[3] = 1;
+    bounds->max[3] = 1;
+    fwrite(bounds, 1, sizeof(struct mdl_bounds), mdl);
 
     // we are writing the bone table offset in the model header
     cur_pos = ftell(mdl);
@@ -707,15 +2653,15 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    for (unsigned int i = 0; i < mesh_nmb; i++) {
-        unsigned int vifp_off[mesh_nmb * vifpkt[i]];
+    for (unsigned int i = 0; i < part_nmb; i++) {
+        unsigned int vifp_off[parts[i].vifpkt];
         int dma_check = 1;
         int mat_check = 1;
-        for (int y = 0; y < vifpkt[i]; y++) {
+        for (int y = 0; y < parts[i].vifpkt; y++) {
 
             vifp_off[y] = ftell(mdl) - 0x90;
             char *kh2vname = (char *)malloc(PATH_MAX * sizeof(char));
-            sprintf(kh2vname, "%s_mp%d_pkt%d.kh2v", argv[1], i + 1, y + 1);
+            sprintf(kh2vname, "%s_mp%d_pkt%d.kh2v", name, i + 1, y + 1);
             FILE *vif_final = fopen(kh2vname, "rb");
 
             size_t n, m;
@@ -732,21 +2678,22 @@ int main(int argc, char *argv[]) {
             remove(kh2vname);
         }
 
-        for (int y = 0; y < vifpkt[i]; y++) {
+        for (int y = 0; y < parts[i].vifpkt; y++) {
 
             char *dmaname = (char *)malloc(PATH_MAX * sizeof(char));
-            sprintf(dmaname, "%s_mp%d_pkt%d.dma", argv[1], i + 1, y + 1);
+            sprintf(dmaname, "%s_mp%d_pkt%d.dma", name, i + 1, y + 1);
             FILE *dma_final;
 
             if (dma_check) {
                 unsigned int cur_pos = ftell(mdl);
-                fseek(mdl, subp_off[i] + 0x10, SEEK_SET);
+                fseek(mdl, parts[i].subp_off + 0x10, SEEK_SET);
                 int dmahdr = cur_pos - 0x90;
                 fwrite(&dmahdr, 1, sizeof(dmahdr), mdl);
 
-                printf("Dma entries: %d\n", dma_entries[i]);
-                fseek(mdl, subp_off[i] + 0x18, SEEK_SET);
-                fwrite(&dma_entries[i], 1, sizeof(dma_entries[i]), mdl);
+                printf("Dma entries: %d\n", parts[i].dma_entries);
+                fseek(mdl, parts[i].subp_off + 0x18, SEEK_SET);
+                fwrite(&parts[i].dma_entries, 1, sizeof(parts[i].dma_entries),
+                       mdl);
 
                 fseek(mdl, cur_pos, SEEK_SET);
                 dma_check = 0;
@@ -773,22 +2720,23 @@ int main(int argc, char *argv[]) {
             remove(dmaname);
         }
 
-        for (int y = 0; y < vifpkt[i]; y++) {
+        for (int y = 0; y < parts[i].vifpkt; y++) {
 
             char *matname = (char *)malloc(PATH_MAX * sizeof(char));
-            sprintf(matname, "%s_mp%d_pkt%d.mat", argv[1], i + 1, y + 1);
+            sprintf(matname, "%s_mp%d_pkt%d.mat", name, i + 1, y + 1);
             FILE *mat_final;
 
             if (mat_check) {
                 unsigned int cur_pos = ftell(mdl);
-                fseek(mdl, subp_off[i] + 0x14, SEEK_SET);
+                fseek(mdl, parts[i].subp_off + 0x14, SEEK_SET);
                 unsigned int mathdr = cur_pos - 0x90;
                 fwrite(&mathdr, 1, sizeof(mathdr), mdl);
                 fseek(mdl, cur_pos, SEEK_SET);
 
-                printf("Mat entries: %d\n", mat_entries[i]);
+                printf("Mat entries: %d\n", parts[i].mat_entries);
                 mat_final = fopen(matname, "rb+");
-                fwrite(&mat_entries[i], 1, sizeof(mat_entries[i]), mat_final);
+                fwrite(&parts[i].mat_entries, 1, sizeof(parts[i].mat_entries),
+                       mat_final);
                 fclose(mat_final);
 
                 mat_check = 0;
@@ -814,4 +2762,55 @@ int main(int argc, char *argv[]) {
         }
     }
     fclose(mdl);
+
+    // collision comes from the model itself unless we were given a dedicated
+    // mesh, whose bones we match to ours by name
+    const aiScene *coll_scene = scene;
+    Assimp::Importer coll_importer;
+    if (coll_name) {
+        coll_importer.SetPropertyInteger(
+            AI_CONFIG_PP_RVC_FLAGS,
+            aiComponent_NORMALS | aiComponent_TANGENTS_AND_BITANGENTS |
+                aiComponent_COLORS | aiComponent_LIGHTS | aiComponent_CAMERAS);
+        coll_scene = coll_importer.ReadFile(
+            coll_name, aiProcess_Triangulate | aiProcess_RemoveComponent |
+                           aiProcess_JoinIdenticalVertices |
+                           aiProcess_SortByPType);
+        if (!coll_scene) {
+            printf("error loading collision!: %s",
+                   coll_importer.GetErrorString());
+            return -1;
+        }
+    }
+    int *bone_idx[coll_scene->mNumMeshes];
+    for (unsigned int i = 0; i < coll_scene->mNumMeshes; i++) {
+        const aiMesh &mesh = *coll_scene->mMeshes[i];
+        bone_idx[i] = (int *)malloc((mesh.mNumBones + 1) * sizeof(int));
+        for (unsigned int j = 0; j < mesh.mNumBones; j++) {
+            bone_idx[i][j] = -1;
+            if (coll_scene == scene) {
+                bone_idx[i][j] = bones_prec[i] + j;
+                continue;
+            }
+            for (unsigned int m = 0; m < mesh_nmb && bone_idx[i][j] < 0; m++) {
+                const aiMesh &mdl_mesh = *scene->mMeshes[m];
+                for (unsigned int b = 0; b < mdl_mesh.mNumBones; b++) {
+                    if (strcmp(mdl_mesh.mBones[b]->mName.C_Str(),
+                               mesh.mBones[j]->mName.C_Str()) == 0) {
+                        bone_idx[i][j] = bones_prec[m] + b;
+                        break;
+                    }
+                }
+            }
+            if (bone_idx[i][j] < 0) {
+                printf("warning: collision bone %s isn't in the model\n",
+                       mesh.mBones[j]->mName.C_Str());
+            }
+        }
+    }
+    int ret = write_collision(coll_scene, bone_idx, name);
+    for (unsigned int i = 0; i < coll_scene->mNumMeshes; i++) {
+        free(bone_idx[i]);
+    }
+    return ret;
 }